@@ -12,9 +12,14 @@
 #include <linux/mod_devicetable.h>
 #include <linux/qpnp/qpnp-adc.h>
 #include <linux/workqueue.h>
-#include <asm/delay.h>
 #include <linux/kobject.h>
 #include <linux/sysfs.h>
+#include <linux/rcupdate.h>
+#include <linux/math64.h>
+#include <linux/spinlock.h>
+#include <linux/seqlock.h>
+#include <linux/reboot.h>
+#include <linux/notifier.h>
 #include "battery_core.h"
 #include "charger_core.h"
 
@@ -22,21 +27,17 @@
 umode_t battery_attr_is_visible(struct kobject *kobj,struct attribute *attr, int attrno);
 ssize_t battery_show_property(struct device *dev,struct  device_attribute *attr, char* buf);
 ssize_t battery_store_property(struct device *dev,struct device_attribute *attr, const char* buf, size_t count);
+void battery_core_charger_event(void* data, unsigned int events);
+void battery_core_read_snapshot(struct battery_core_interface* bat, struct battery_core_snapshot* snap);
+void battery_core_monitor_kick(struct battery_core_interface* bat);
+int battery_core_monitor_critical(struct battery_core_interface* bat, int volt, int temp);
+int battery_core_counter_current(struct battery_core_interface* bat);
 
 
 //*****************************************************
 //*  Таблица соответствия напряжения и уровня заряда
 //*****************************************************
 
-struct capacity {
-  int percent;
-  int vmin;
-  int vmax;
-  int offset;
-  int hysteresis;
-};
-  
-// 
 struct capacity battery_capacity_table[12]= {
 //  %       vmin     vmax   offset hysteresis
    {0,      3100,    3597,    0,    10},
@@ -60,11 +61,6 @@ struct capacity battery_capacity_table[12]= {
 //*****************************************************
 //*  Таблица перевода напряжения в температуру
 //*****************************************************
-struct ntc_tvm {
-   int tntc;
-   int tnvc;
-};
-
 struct ntc_tvm ntc_tvm_tables[] = {
 // температура  напряжение
      {-45,      1800000},         
@@ -105,6 +101,63 @@ struct ntc_tvm ntc_tvm_tables[] = {
 };    
 
 #define ntc_table_size 35
+#define ntc_table_vref 1800000  // опорное напряжение АЦП по умолчанию, мкВ
+
+//*****************************************************
+//*  Временные параметры шагов монитора, мс
+//*****************************************************
+#define BATTERY_MON_SETTLE_DELAY  1000  // стабилизация напряжения на батарее после остановки зарядки
+#define BATTERY_MON_KICK_DELAY    50    // подавление дребезга событий зарядника перед внеочередным циклом
+#define BATTERY_MON_FAST_SETTLE_DELAY 200 // стабилизация в цикле быстрого старта
+
+//*****************************************************
+//*  Параметры компенсации внутреннего сопротивления
+//*****************************************************
+#define BATTERY_IR_LEARN_CYCLES   16    // по умолчанию - пауза зарядки раз в столько циклов
+#define BATTERY_IR_MIN_CURRENT    100   // меньший зарядный ток не дает измеримого скачка, мА
+#define BATTERY_IR_SAMPLE_DELAY   20    // выборка после остановки зарядки: ток уже спал, поляризация еще нет, мс
+
+//*****************************************************
+//*  Параметры адаптивного периода монитора
+//*****************************************************
+// Границы периода задают charging_monitor_period и discharging_monitor_period
+#define BATTERY_MON_PERIOD_FLOOR  1000   // нижний предел периода, мс
+#define BATTERY_MON_SLOPE_WEIGHT  4      // вес сглаживания скорости изменения напряжения
+#define BATTERY_MON_DV_STEP       10000  // допустимое изменение напряжения за период, мкВ
+#define BATTERY_MON_APPROACH_DIV  4      // число циклов до достижения low_volt
+#define BATTERY_MON_TEMP_FAR      100    // расстояние до порога температуры без ускорения, 0.1 C
+#define BATTERY_MON_SAFETY_MULT   4      // жесткий срок проверки безопасности в больших периодах
+
+//*****************************************************
+//*  Параметры интервала пробуждения из suspend, мс
+//*****************************************************
+#define BATTERY_WAKE_MAX          14400000  // здоровая батарея без зарядки - 4 часа
+#define BATTERY_WAKE_MIN          60000     // батарея у порога отключения
+#define BATTERY_WAKE_CHARGING     600000    // во время зарядки
+#define BATTERY_WAKE_TEMP         300000    // температура рядом с порогами
+#define BATTERY_WAKE_LOW_CAPACITY 15        // ниже этого уровня интервал сокращается пропорционально, %
+#define BATTERY_WAKE_MARGIN_DIV   2         // запас по времени до low_volt/poweroff_volt
+#define BATTERY_RESUME_RESEED_MIN 60000     // более короткий сон интегратор не переинициализирует
+#define BATTERY_RESUME_RESEED_TAU 1800000   // сон, после которого старая история весит половину
+
+// Вес первой выборки после сна - slept/(slept+TAU). TAU взят по времени релаксации
+// напряжения литиевой батареи без нагрузки: примерно за полчаса поляризация спадает,
+// и напряжение приближается к OCV. После минутного сна вес около 1/31 - выборка
+// еще искажена поляризацией и почти не сдвигает интегратор. После получаса вес 1/2,
+// после 4 часов (BATTERY_WAKE_MAX) - около 8/9, и емкость следует уже за OCV.
+
+//*****************************************************
+//*  Модель нагрузки счетчика заряда по умолчанию, мА
+//*****************************************************
+// Порядок величины для модема; уточняется battery-core,load-model-ma
+#define BATTERY_LOAD_ACTIVE_MA    200
+#define BATTERY_LOAD_SLEEP_MA     5
+
+//*****************************************************
+//*  Параметры сохранения состояния между перезагрузками
+//*****************************************************
+#define BATTERY_STATE_SAVE_PERIOD 600000    // период записи блока состояния, мс
+#define BATTERY_STATE_SEED_TOLERANCE 50000  // расхождение сохраненного интегратора с измерением, мкВ
 
 //*****************************************************
 //*   Таблица sysfs-атрибутов
@@ -159,7 +212,7 @@ static struct attribute* battery_attrs[]={
 };
 */
 
-static struct device_attribute battery_dev_attrs[21]={
+static struct device_attribute battery_dev_attrs[30]={
  {{"capacity", 0},                   &battery_show_property, &battery_store_property},
  {{"ntc", 0},                        battery_show_property, battery_store_property},
  {{"precharge_voltage", 0},          battery_show_property, battery_store_property},
@@ -180,7 +233,16 @@ static struct device_attribute battery_dev_attrs[21]={
  {{"disable_charging", 0},           battery_show_property, battery_store_property},
  {{"high_voltage", 0},               battery_show_property, battery_store_property},
  {{"capacity_changed_margin", 0},    battery_show_property, battery_store_property},
- {{"debug_mode", 0},                 battery_show_property, battery_store_property}
+ {{"debug_mode", 0},                 battery_show_property, battery_store_property},
+ {{"generation", 0},                 battery_show_property, battery_store_property},
+ {{"monitor_placement", 0},          battery_show_property, battery_store_property},
+ {{"monitor_cpu", 0},                battery_show_property, battery_store_property},
+ {{"cycle_count", 0},                battery_show_property, battery_store_property},
+ {{"ir_compensation", 0},            battery_show_property, battery_store_property},
+ {{"pause_saved_ms", 0},             battery_show_property, battery_store_property},
+ {{"internal_resistance", 0},        battery_show_property, battery_store_property},
+ {{"soc_engine", 0},                 battery_show_property, battery_store_property},
+ {{"load_model", 0},                 battery_show_property, battery_store_property}
 };
 
 static struct attribute* battery_attrs[]={
@@ -205,6 +267,15 @@ static struct attribute* battery_attrs[]={
   &battery_dev_attrs[18].attr,
   &battery_dev_attrs[19].attr,
   &battery_dev_attrs[20].attr,
+  &battery_dev_attrs[21].attr,
+  &battery_dev_attrs[22].attr,
+  &battery_dev_attrs[23].attr,
+  &battery_dev_attrs[24].attr,
+  &battery_dev_attrs[25].attr,
+  &battery_dev_attrs[26].attr,
+  &battery_dev_attrs[27].attr,
+  &battery_dev_attrs[28].attr,
+  &battery_dev_attrs[29].attr,
   0
 };
 
@@ -216,6 +287,53 @@ static struct attribute_group battery_attr_group={
   battery_attrs
 }; 
 
+//*****************************************************
+//*  Публикация состояния батареи для читателей
+//*****************************************************
+// Рабочие поля копируются под bat->lock, затем копия целиком
+// подменяет snap под seqlock.
+void battery_core_publish(struct battery_core_interface* bat) {
+
+struct battery_core_snapshot snap;
+
+mutex_lock(&bat->lock);
+snap.status=bat->status;
+snap.health=bat->health;
+snap.present=bat->present;
+snap.volt_now=bat->volt_now;
+snap.volt_avg=bat->volt_avg;
+snap.volt_max=bat->volt_max;
+snap.current_now=bat->current_now;
+snap.current_max=bat->current_max;
+snap.capacity=bat->capacity;
+snap.temp=bat->temp;
+snap.resistance=bat->ir_mohm*1000;
+snap.soc_engine=bat->soc_engine;
+// ток счетчика заряда меняется вместе с публикуемым состоянием
+battery_counter_set_current(&bat->counter,battery_core_counter_current(bat),ktime_to_ms(ktime_get_boottime()));
+snap.counter=bat->counter;
+mutex_unlock(&bat->lock);
+
+write_seqlock(&bat->snap_lock);
+snap.generation=bat->snap.generation+1;
+bat->snap=snap;
+write_sequnlock(&bat->snap_lock);
+}
+
+//*****************************************************
+//*  Чтение опубликованного состояния батареи
+//*****************************************************
+// Без блокировок: копия повторяется, если во время чтения прошла публикация
+void battery_core_read_snapshot(struct battery_core_interface* bat, struct battery_core_snapshot* snap) {
+
+unsigned int seq;
+
+do {
+  seq=read_seqbegin(&bat->snap_lock);
+  *snap=bat->snap;
+} while (read_seqretry(&bat->snap_lock,seq));
+}
+
 //*****************************************************
 //*  Таблица параметров батарейки
 //*****************************************************
@@ -229,7 +347,10 @@ static enum power_supply_property battery_core_power_props[] = {
   POWER_SUPPLY_PROP_CAPACITY, 
   POWER_SUPPLY_PROP_VOLTAGE_MAX, 
   POWER_SUPPLY_PROP_CURRENT_MAX, 
-  POWER_SUPPLY_PROP_CURRENT_NOW
+  POWER_SUPPLY_PROP_CURRENT_NOW,
+  POWER_SUPPLY_PROP_RESISTANCE,
+  POWER_SUPPLY_PROP_CHARGE_NOW,
+  POWER_SUPPLY_PROP_CHARGE_COUNTER
 };  
 
 //*****************************************************
@@ -250,46 +371,71 @@ return 0;
 int battery_core_get_property(struct power_supply *psy,enum power_supply_property psp,union power_supply_propval *val) {
   
 struct battery_core_interface* bat=container_of(psy, struct battery_core_interface, psy);  
+struct battery_core_snapshot snap;
+int cap;
+
+battery_core_read_snapshot(bat,&snap);
 
 switch(psp){
   case POWER_SUPPLY_PROP_STATUS:
-    val->intval=bat->status;
+    val->intval=snap.status;
     break;
   
   case POWER_SUPPLY_PROP_HEALTH:
-    val->intval=bat->health;
+    val->intval=snap.health;
     break;
     
   case POWER_SUPPLY_PROP_PRESENT:  
-    val->intval=bat->present;
+    val->intval=snap.present;
     break;
     
   case POWER_SUPPLY_PROP_VOLTAGE_MAX:  
-    val->intval=bat->volt_max;
+    val->intval=snap.volt_max;
     break;
     
   case POWER_SUPPLY_PROP_VOLTAGE_NOW:  
-    val->intval=bat->volt_now;
+    val->intval=snap.volt_now;
     break;
     
   case POWER_SUPPLY_PROP_VOLTAGE_AVG:  
-    val->intval=bat->volt_avg;
+    val->intval=snap.volt_avg;
     break;
     
   case POWER_SUPPLY_PROP_CURRENT_MAX:  
-    val->intval=bat->current_max;
+    val->intval=snap.current_max;
     break;
     
   case POWER_SUPPLY_PROP_CURRENT_NOW:  
-    val->intval=bat->current_now;
+    val->intval=snap.current_now;
     break;
     
   case POWER_SUPPLY_PROP_CAPACITY:  
-    val->intval=bat->capacity;
+    val->intval=snap.capacity;
+    // счетчик заряда уточняет уровень между циклами монитора
+    if (snap.soc_engine == BATTERY_SOC_COUNTER) {
+      cap=battery_counter_percent_at(&snap.counter,ktime_to_ms(ktime_get_boottime()));
+      if (cap >= 0) val->intval=cap;
+    }  
+    break;
+    
+  case POWER_SUPPLY_PROP_CHARGE_NOW:
+    // без емкости аккумулятора или до первой привязки к OCV остаток неизвестен
+    if ((snap.counter.full <= 0) || (snap.counter.valid == 0)) return -ENODATA;
+    val->intval=(int)div64_s64(battery_counter_charge_at(&snap.counter,ktime_to_ms(ktime_get_boottime())),
+                               BATTERY_COUNTER_MAMS_PER_UAH);
+    break;
+    
+  case POWER_SUPPLY_PROP_CHARGE_COUNTER:
+    val->intval=(int)div64_s64(battery_counter_total_at(&snap.counter,ktime_to_ms(ktime_get_boottime())),
+                               BATTERY_COUNTER_MAMS_PER_UAH);
     break;
     
   case POWER_SUPPLY_PROP_TEMP:  
-    val->intval=bat->temp;
+    val->intval=snap.temp;
+    break;
+    
+  case POWER_SUPPLY_PROP_RESISTANCE:
+    val->intval=snap.resistance;
     break;
     
   default:
@@ -306,10 +452,60 @@ int battery_core_wakeup(void *self) {
   
 struct battery_core_interface* bat=self;
 
+// Будильник срабатывает, пока монитор еще остановлен (mon_stopped), поэтому
+// запускать цикл здесь бесполезно. Лишь не даем системе снова уснуть до
+// timer_resume_proc - внеочередной цикл после сна запускает именно он.
 if (!bat->ws.active) __pm_stay_awake(&bat->ws);
 return 0;
 }
 
+//*****************************************************
+//*  Интервал пробуждения из suspend
+//*****************************************************
+// Вызывается драйвером батарейки перед уходом в suspend, результат в *ms.
+// Интервал оценивается по времени, за которое батарея при текущей скорости разряда
+// дойдет до low_volt (ниже него - до poweroff_volt), с запасом BATTERY_WAKE_MARGIN_DIV,
+// и сокращается при низком заряде, во время зарядки и у температурных порогов.
+int battery_core_x_timer_suspend(struct battery_core_interface* bat, int* ms) {
+
+int interval,volt,d,rate,t;
+
+if ((bat == 0) || (ms == 0)) return -EINVAL;
+
+interval=BATTERY_WAKE_MAX;
+volt=bat->volt_avg/1000;
+
+// низкий заряд: интервал пропорционален остатку
+if ((bat->capacity >= 0) && (bat->capacity < BATTERY_WAKE_LOW_CAPACITY)) 
+  interval=(int)div_s64((s64)BATTERY_WAKE_MAX*bat->capacity,BATTERY_WAKE_LOW_CAPACITY);
+
+// расстояние до порога отключения по напряжению
+d=volt-bat->low_volt;
+if (d <= 0) d=volt-bat->poweroff_volt;
+if ((volt > 0) && (d <= 0)) interval=BATTERY_WAKE_MIN;
+else if ((bat->status == POWER_SUPPLY_STATUS_DISCHARGING) && (bat->mon_slope < 0)) {
+  rate=-bat->mon_slope;  // мкВ/с
+  // время до порога, мс
+  t=(int)min_t(s64,div_s64((s64)d*1000000,rate)/BATTERY_WAKE_MARGIN_DIV,BATTERY_WAKE_MAX);
+  if (t < interval) interval=t;
+}
+
+// зарядка: отслеживаем окончание заряда
+if (bat->status != POWER_SUPPLY_STATUS_DISCHARGING) interval=min(interval,BATTERY_WAKE_CHARGING);
+
+// температура рядом с порогами запрета зарядки или отключения
+if (battery_core_monitor_critical(bat,0,bat->temp_dc) ||
+    (abs(bat->temp_dc-bat->temp_high_disable_charge*10) < BATTERY_MON_TEMP_FAR) ||
+    (abs(bat->temp_dc-bat->temp_low_disable_charge*10) < BATTERY_MON_TEMP_FAR)) 
+  interval=min(interval,BATTERY_WAKE_TEMP);
+
+if (interval < BATTERY_WAKE_MIN) interval=BATTERY_WAKE_MIN;
+*ms=interval;
+if (bat->debug_mode) pr_info("suspend wake interval %ds (vbat=%dmV, capacity=%d%%, dV/dt=%duV/s)\n",
+       interval/1000,volt,bat->capacity,bat->mon_slope);
+return 0;
+}
+
 //*****************************************************
 //* Запись параметра батареи
 //*****************************************************
@@ -343,9 +539,87 @@ switch (psp) {
   default:
     ret=-EINVAL;
 }    
+mutex_unlock(&bat->lock);
+if (ret == 0) battery_core_publish(bat);
 return ret;
 }
 
+//*****************************************************
+//*   Привязка к драйверу зарядника
+//*****************************************************
+// Зарядник может зарегистрироваться позже батарейки: привязка выполняется один раз,
+// при регистрации батарейки или по уведомлению charger_core. bat->charger держит
+// собственную ссылку на зарядник; пользователи берут временную ссылку через
+// battery_core_get_charger и возвращают ее через charger_core_put.
+struct charger_core_interface* battery_core_get_charger(struct battery_core_interface* bat) {
+
+struct charger_core_interface* chip;
+unsigned long flags;
+
+spin_lock_irqsave(&bat->mon_lock,flags);
+chip=charger_core_get(bat->charger);
+spin_unlock_irqrestore(&bat->mon_lock,flags);
+return chip;
+}
+
+// Забирает ссылку chip; если зарядник уже привязан - ссылка возвращается
+void battery_core_attach_charger(struct battery_core_interface* bat, struct charger_core_interface* chip) {
+
+unsigned long flags;
+int attached=0;
+
+if (chip == 0) return;
+spin_lock_irqsave(&bat->mon_lock,flags);
+if (bat->charger == 0) {
+  bat->charger=chip;
+  attached=1;
+}  
+spin_unlock_irqrestore(&bat->mon_lock,flags);
+if (attached == 0) {
+  charger_core_put(chip);
+  return;
+}
+// обработчик ставится вне mon_lock: charger_core вызывает его под своей блокировкой
+if (charger_core_set_event_handler(chip,battery_core_charger_event,bat) == 0) bat->charger_bound=1;
+pr_info("charger %s attached\n",chip->name);
+battery_core_charger_event(bat,CHARGER_EVENT_SOURCE);
+}
+
+// Возвращает ссылку bat->charger вызывающему, после выхода события зарядника не приходят
+struct charger_core_interface* battery_core_detach_charger(struct battery_core_interface* bat) {
+
+struct charger_core_interface* chip;
+unsigned long flags;
+
+chip=ACCESS_ONCE(bat->charger);
+if (chip == 0) return 0;
+if (bat->charger_bound != 0) charger_core_set_event_handler(chip,0,0);
+bat->charger_bound=0;
+spin_lock_irqsave(&bat->mon_lock,flags);
+bat->charger=0;
+spin_unlock_irqrestore(&bat->mon_lock,flags);
+return chip;
+}
+
+int battery_core_charger_notify(struct notifier_block* nb, unsigned long event, void* data) {
+
+struct battery_core_interface* bat=container_of(nb, struct battery_core_interface, charger_nb);
+struct charger_core_interface* chip=data;
+
+if (strcmp(chip->name,bat->bname) != 0) return NOTIFY_DONE;
+switch (event) {
+  case CHARGER_CORE_REGISTERED:
+    battery_core_attach_charger(bat,charger_core_get(chip));
+    break;
+  case CHARGER_CORE_UNREGISTERED:
+    if (ACCESS_ONCE(bat->charger) != chip) break;
+    charger_core_put(battery_core_detach_charger(bat));
+    pr_info("charger %s detached\n",chip->name);
+    break;
+}
+return NOTIFY_OK;
+}
+
 //*****************************************************
 //*   Установка зарядного тока батареи
 //*****************************************************
@@ -353,15 +627,17 @@ int battery_core_set_ibat(struct battery_core_interface* bat, int mA) {
 
 struct charger_info chg_info;
 struct charger_interface* api;
+struct charger_core_interface* chg;
 
 chg_info.ichg_now=0;
 chg_info.ada_connected=0;
 
-if (bat->charger == 0) bat->charger=charger_core_get_charger_interface_by_name(bat->bname);
-if (bat->charger != 0) {
-  api=bat->charger->api;
+chg=battery_core_get_charger(bat);
+if (chg != 0) {
+  api=chg->api;
   if (api->set_charging_current != 0) (*api->set_charging_current)(api,mA);
   if (api->get_charger_info != 0) (*api->get_charger_info)(api,&chg_info);
+  charger_core_put(chg);
 }
 
 bat->current_now = chg_info.ichg_now*1000;
@@ -372,6 +648,7 @@ else {
   else bat->status=POWER_SUPPLY_STATUS_NOT_CHARGING;
 }
 
+battery_core_publish(bat);
 power_supply_changed(&bat->psy);
 return 0;
 }
@@ -389,180 +666,302 @@ else mA=bat->current_max/1000;
 battery_core_set_ibat(bat,mA);
 }
 
+//*****************************************************
+//*  Уведомление об изменении источника питания
+//*****************************************************
+// Вызывается ядром power supply, когда изменился один из поставщиков батареи.
+// Какой именно - неизвестно, поэтому сбрасывается кеш всех адаптеров зарядника.
+void battery_core_supply_changed(struct power_supply *psy) {
+
+struct battery_core_interface* bat=container_of(psy, struct battery_core_interface, psy);  
+struct charger_core_interface* chg;
+
+chg=battery_core_get_charger(bat);
+if (chg != 0) charger_core_adapter_changed(chg->api,0);
+charger_core_put(chg);
+battery_core_external_power_changed(psy);
+}
+
 //*****************************************************
 //*  Вычисление среднего
 //*****************************************************
-int battery_core_calculate_average(int* data) {
+// Среднее n выборок без максимальной и минимальной (для n<3 отбрасывать нечего)
+int battery_core_calculate_average_n(int* data, int n) {
   
 int i;
 int max,min,v;
 int sum=0;
 sum=max=min=data[0];
 
-for(i=1;i<8;i++) {
+for(i=1;i<n;i++) {
   v=data[i];
   if (v>max) max=v;
   else if (v<min) min=v;
   sum+=v;
 }
-return(sum-max-min)/6;
+if (n<3) return sum/n;
+return(sum-max-min)/(n-2);
 
 }
 
-//*****************************************************
-//*  Монитор состояния батареи
-//*****************************************************
-void battery_core_monitor_work(struct work_struct *work) {
+int battery_core_calculate_average(int* data) {
   
+return battery_core_calculate_average_n(data,BATTERY_MON_SAMPLES);
+}
 
-int data[8];  
+//*****************************************************
+//*  Разброс выборок (max-min)
+//*****************************************************
+int battery_core_calculate_spread(int* data, int n) {
 
-struct battery_interface* api;
-struct delayed_work* dw=container_of(work, struct delayed_work, work);
-struct battery_core_interface* bat=container_of(dw, struct battery_core_interface, work);  
-struct charger_interface* capi;
 int i;
-int rc;
-int temp=0;
-int health;
-int volt;
-int new_status;  // R6
-int cap;
-int current_max;
-int integrated_volt, mvavg;
-int dv,cm;
-int bpr,offset,capupdate,hyst;
-int monperiod;
-
-// Хранилище для вычисления среднего напряжения между циклами монитора (интегратор напряжения)
-static int sum,count,average,calculate_initialized;
+int max,min;
 
+max=min=data[0];
+for(i=1;i<n;i++) {
+  if (data[i]>max) max=data[i];
+  else if (data[i]<min) min=data[i];
+}
+return max-min;
+}
 
-if (!bat->ws.active) __pm_stay_awake(&bat->ws);
-api=bat->api;
-memset(data,0,32);
-if (api-> get_vntc_proc != 0) {
-//  r7=-22;
+//*****************************************************
+//*  Пересчет напряжения NTC в температуру
+//*****************************************************
+// Возвращает температуру в 0.1 C, без таблицы NTC - 25 C
+int battery_core_vntc_to_temp(struct battery_core_interface* bat, int vntc) {
+
+int temp;   // 0.1 C
+int clamped;
+struct battery_ntc_table* tbl;
+
+rcu_read_lock();
+tbl=rcu_dereference(bat->ntc);
+if (tbl == 0) {
+  rcu_read_unlock();
+  pr_err("NTC convert table is NULL!\n");
+  return 250;
+}  
+if (tbl->calib_scale != 0) vntc=(int)(((s64)vntc*tbl->calib_scale)>>BATTERY_NTC_CALIB_SHIFT);
+temp=ntc_lookup_temp(&tbl->lookup,vntc,&clamped);
+rcu_read_unlock();
+if (clamped) pr_err_ratelimited("NTC voltage %duV is out of table, temperature clamped to %d(0.1C)\n",vntc,temp);
+return temp;
 }
+
+//*****************************************************
+//*  Пересчет напряжения NTC в температуру и состояние
+//*****************************************************
+void battery_core_update_temp(struct battery_core_interface* bat, int vntc) {
+
+int temp;   // 0.1 C
+int health;
+
+temp=battery_core_vntc_to_temp(bat,vntc);
+health=POWER_SUPPLY_HEALTH_GOOD;
+if ((temp>bat->temp_high_poweroff*10) || (temp<bat->temp_low_poweroff*10)) health=POWER_SUPPLY_HEALTH_DEAD;
 else {
-  if (api->x40 == 0) goto donetemp;
-//  else r7=-22;  
+  if (temp>bat->temp_high_disable_charge*10) health=POWER_SUPPLY_HEALTH_OVERHEAT;
+  if (temp<bat->temp_low_disable_charge*10) health=POWER_SUPPLY_HEALTH_COLD;
 }
 
-for (i=0;i<8;i++) {
-  if (api-> get_vntc_proc != 0) rc= (*api-> get_vntc_proc)(api,&data[i]);
-  else if (api-> x40 != 0) rc= (api-> x40)(api->thisptr,&data[i]);
-  if (rc != 0) {
-    pr_err("failed to measure battery temperature, rc=%d\n",rc);
-    goto donetemp;
+mutex_lock(&bat->lock);
+bat->temp_dc=temp;
+bat->temp=DIV_ROUND_CLOSEST(temp,10);
+bat->health=health;
+mutex_unlock(&bat->lock);
+}
+
+//*****************************************************
+//*  Чтение сохраненного состояния
+//*****************************************************
+// Блок читается один раз; если хранилище еще недоступно (файловая система не
+// смонтирована) - попытка повторяется при следующем вызове.
+// Возвращает 1, если bat->saved содержит проверенный блок.
+int battery_core_state_restore(struct battery_core_interface* bat) {
+
+int rc,i;
+
+if (bat->state == 0) return 0;
+mutex_lock(&bat->state_lock);
+if (bat->state_loaded == 0) {
+  rc=battery_state_load(bat->state,&bat->saved);
+  if (rc == 0) {
+    bat->state_loaded=1;
+    // учтенное до прочтения блока добавляется к сохраненному
+    for (i=0;i<BATTERY_IR_BINS;i++) {
+      if (battery_ir_bin_value(&bat->irest,i) == 0) battery_ir_set_bin(&bat->irest,i,bat->saved.ir_bins[i]);
+    }  
+    if (bat->ir_mohm == 0) bat->ir_mohm=bat->saved.ir_mohm;
+    bat->cycle_pct+=bat->saved.cycle_pct;
+    pr_info("restored battery state from %s: capacity %d%%, %u cycles\n",bat->state->name,
+        bat->saved.capacity,bat->saved.cycle_pct/100);
   }
-  (*arm_delay_ops.const_udelay)(1073740);
+  else if (rc == -EBADMSG) pr_err("battery state in %s is corrupted, ignored\n",bat->state->name);
+  else if (bat->debug_mode) pr_info("battery state not available, rc=%d\n",rc);
+}  
+rc=bat->state_loaded;
+mutex_unlock(&bat->state_lock);
+return rc;
 }
-if (api-> get_vntc_proc != 0) {
-   rc=battery_core_calculate_average(data);
-   if (bat->ntc == 0) {
-     pr_err("NTC convert table is NULL!\n");
-     temp=25;
-   }  
-   else {
-     if (bat->vref != bat-> vref_calib) rc=rc*bat->vref_calib/bat->vref;
-     for(i=0;i<bat->ntcsize-1;i++) {
-       if ((rc<bat->ntc[i].tnvc) && (rc>bat->ntc[i+1].tnvc)) temp=bat->ntc[i].tntc;
-     }
-   }  
-   health=POWER_SUPPLY_HEALTH_GOOD;
-   if ((temp>bat->temp_high_poweroff) || (temp<bat->temp_low_poweroff)) health=POWER_SUPPLY_HEALTH_DEAD;
-   else {
-     if (temp>bat->temp_high_disable_charge) health=POWER_SUPPLY_HEALTH_OVERHEAT;
-     if (temp<bat->temp_low_disable_charge) health=POWER_SUPPLY_HEALTH_COLD;
-   }
-   
-   mutex_lock(&bat->lock);
-   bat->temp=temp;
-   bat->health=health;
-   
-   mutex_unlock(&bat->lock);
+
+//*****************************************************
+//*  Запись текущего состояния
+//*****************************************************
+void battery_core_state_store(struct battery_core_interface* bat) {
+
+struct battery_state_blob blob;
+int rc,i;
+
+if (bat->state == 0) return;
+// до первого измерения и в тестовом режиме сохранять нечего
+if ((bat->mon_fast_start != 0) || (bat->test_mode != 0) || (bat-> present != 1)) return;
+// блок еще не прочитан (хранилище стало доступно позже) - сначала читаем, чтобы не затереть
+battery_core_state_restore(bat);
+
+memset(&blob,0,sizeof(blob));
+mutex_lock(&bat->lock);
+blob.capacity=bat->capacity;
+blob.volt_avg=bat->volt_avg;
+blob.ir_mohm=bat->ir_mohm;
+blob.cycle_pct=bat->cycle_pct;
+blob.temp_dc=bat->temp_dc;
+mutex_unlock(&bat->lock);
+for (i=0;i<BATTERY_IR_BINS;i++) blob.ir_bins[i]=battery_ir_bin_value(&bat->irest,i);
+
+mutex_lock(&bat->state_lock);
+rc=battery_state_save(bat->state,&blob);
+bat->state_time=ktime_get_boottime();
+mutex_unlock(&bat->state_lock);
+if ((rc != 0) && (bat->debug_mode)) pr_info("battery state not saved to %s, rc=%d\n",bat->state->name,rc);
 }
-donetemp:
 
-//------------------------------------------------------------------------------------------------
-// Температуру измерили, теперь измеряем напряжение
+//*****************************************************
+//*  Запись состояния при выключении и перезагрузке
+//*****************************************************
+int battery_core_state_reboot(struct notifier_block* nb, unsigned long code, void* unused) {
 
-cap=99;
-memset(data,0,32);
-
-// приостанавливаем зарядку и ждем стабилизации напряжения на батарее
-if (bat->charger == 0) bat->charger=charger_core_get_charger_interface_by_name(bat->bname);
-if (bat->charger != 0) {
-  capi=bat->charger->api;
-  if (capi->suspend_charging != 0) {
-    rc=(*capi->suspend_charging)(capi);
-    if (rc == 0) {
-      for(i=0;i<11;i++) {
-	(*arm_delay_ops.const_udelay)(107374000);
-      }
-    }
-  }
-}  
+struct battery_core_interface* bat=container_of(nb, struct battery_core_interface, state_nb);
 
+battery_core_state_store(bat);
+return NOTIFY_DONE;
+}
 
-// 8 выборок напряжения
-if (api-> get_vbat_proc == 0) goto no_vbat_proc;
-for (i=0;i<8;i++) {
-  rc= (*api-> get_vbat_proc)(api,&data[i]);
-  if (rc != 0) {
-    pr_err("failed to measure battery voltage, rc=%d\n",rc);
-    goto no_vbat_proc;
-  }  
-  (*arm_delay_ops.const_udelay)(1073740);  // задержка на время нового преобразования
+//*****************************************************
+//*  Оценка уровня заряда интегратором напряжения
+//*****************************************************
+// Уровень - по выходу интегратора, отображаемый уровень меняется только
+// при выходе напряжения из полосы гистерезиса строки таблицы.
+int battery_core_soc_integrator(struct battery_core_interface* bat, const struct battery_soc_input* in, int* capupdate) {
+
+*capupdate=capacity_curve_changed(in->curve,in->capacity,in->mv_avg);
+return capacity_curve_percent(in->curve,in->mv_avg,in->charging);
 }
 
-// возобновляем зарядку
-if (bat->charger != 0) {
-  capi=bat->charger->api;
-  if (capi->resume_charging != 0) (*capi->resume_charging)(capi);
+//*****************************************************
+//*  Оценка уровня заряда фильтром Калмана
+//*****************************************************
+// Фильтр сам сглаживает измерения, поэтому работает на напряжении цикла, а не
+// на выходе интегратора.
+int battery_core_soc_kalman(struct battery_core_interface* bat, const struct battery_soc_input* in, int* capupdate) {
+
+int cap;
+
+cap=battery_soc_kalman_update(&bat->kalman,in);
+*capupdate=(cap != in->capacity);
+return cap;
+}
+
+//*****************************************************
+//*  Оценка уровня заряда счетчиком заряда
+//*****************************************************
+// Пока счетчик ни разу не привязан к OCV или емкость аккумулятора
+// неизвестна - уровень по интегратору.
+int battery_core_soc_counter(struct battery_core_interface* bat, const struct battery_soc_input* in, int* capupdate) {
+
+int cap;
+
+cap=battery_counter_percent_at(&bat->counter,ktime_to_ms(ktime_get_boottime()));
+if (cap < 0) return battery_core_soc_integrator(bat,in,capupdate);
+*capupdate=(cap != in->capacity);
+return cap;
+}
+
+static const struct battery_soc_engine battery_core_soc_engines[BATTERY_SOC_COUNT]={
+  {"integrator", battery_core_soc_integrator},
+  {"kalman",     battery_core_soc_kalman},
+  {"counter",    battery_core_soc_counter}
+};
+
+//*****************************************************
+//*  Ток для счетчика заряда, мА
+//*****************************************************
+// Вызывается под bat->lock. При зарядке - установленный ток зарядки,
+// иначе - разряд по модели нагрузки.
+int battery_core_counter_current(struct battery_core_interface* bat) {
+
+if (bat->status == POWER_SUPPLY_STATUS_CHARGING) return bat->current_now/1000;
+if (bat->counter_sleeping != 0) return -bat->load_sleep_ma;
+return -bat->load_active_ma;
 }
 
-// усредняем результат 8 выборок
-volt=battery_core_calculate_average(data);
-// в тестовом режиме берем установленное напряжение вместо измеренного
-if (bat->test_mode != 0) volt=bat->volt_now;
+//*****************************************************
+//*  Поиск способа оценки по имени
+//*****************************************************
+int battery_core_parse_soc_engine(const char* name) {
 
-// **** Интегратор напряжения аккумулятора *** (та самая математика, которой я так боялся)
+int i;
+
+for (i=0;i<BATTERY_SOC_COUNT;i++) {
+  if (sysfs_streq(name,battery_core_soc_engines[i].name)) return i;
+}
+return -EINVAL;
+}
+
+//*****************************************************
+//*  Обработка измеренного напряжения аккумулятора
+//*****************************************************
+void battery_core_update_vbat(struct battery_core_interface* bat, int volt) {
+
+int cap;
+int integrated_volt, mvavg;
+int capupdate;
+int saved;
+int rest,rebase;
+int i;
+int est[BATTERY_SOC_COUNT];
+int upd[BATTERY_SOC_COUNT];
+struct battery_soc_input in;
+ktime_t now;
+struct battery_capacity_table* tbl;
+
+cap=99;
+rebase=-1;
+// аккумулятор в покое: первый цикл после регистрации или долгого сна без зарядки
+rest=(bat->mon_fast_start != 0) || ((bat->mon_reseed_weight > 0) && (bat->status != POWER_SUPPLY_STATUS_CHARGING));
+// состояние, сохраненное до перезагрузки, нужно только первому циклу
+if ((bat->mon_fast_start != 0) && (battery_core_state_restore(bat) != 0)) saved=bat->saved.capacity;
+else saved=-1;
+
+// **** Интегратор напряжения аккумулятора
 
 if (bat-> present == 1) {
- // Если флаг present поднят - вычисляем интегральное значение за 32 выборки
- if (calculate_initialized == 0) {
-   // начальный этап накопления данных интегратора - первые 7 выборок считаем просто среднее
-   count++;
-   sum+=volt;
-   average=sum/count;
-   if (count>7) calculate_initialized=1;
- }
- else {
-   // Все последующий выборки, начиная от 8 - учитываем предыдущий хвост
-   if (bat->status == POWER_SUPPLY_STATUS_CHARGING) dv=32;
-   else  dv=((count<32) ? 32 : count);
-   count++;
-   cm=dv*volt+average*(32-dv);
-   if (cm<0) cm+=31;
-   sum+=cm/32;
-   average=sum/count;
-   if (count > 63) {
-     // сделаны 63 выборки - усредняем результат, представляем его как первые 8 выборок новго цикла
-     sum=average*8;
-     count=8;
-     average=sum/8;
-   }
- }
- integrated_volt=average;
+ // первая выборка после долгого suspend - переинициализация с весом по времени сна
+ if (bat->mon_reseed_weight > 0) {
+   // быстрый старт: сохраненный интегратор, близкий к измерению, усредняется с ним
+   if ((saved >= 0) && (bat->saved.volt_avg > 0) && 
+       (abs(volt-bat->saved.volt_avg) < BATTERY_STATE_SEED_TOLERANCE)) {
+     battery_volt_filter_reseed(&bat->vfilter,bat->saved.volt_avg,1<<BATTERY_FILTER_SHIFT);
+     bat->mon_reseed_weight=1<<(BATTERY_FILTER_SHIFT-1);
+   }  
+   integrated_volt=battery_volt_filter_reseed(&bat->vfilter,volt,bat->mon_reseed_weight);
+   bat->mon_reseed_weight=0;
+ }  
+ else integrated_volt=battery_volt_filter_update(&bat->vfilter,volt,bat->status == POWER_SUPPLY_STATUS_CHARGING);
 }
 else {
- // Если флаг present опущен - делаем сброс переменных интегратора
- sum=0;
- count=0;
- average=0;
- calculate_initialized=0;
+ // Если флаг present опущен - делаем сброс интегратора
+ battery_volt_filter_reset(&bat->vfilter);
  integrated_volt=volt;
 } 
 
@@ -570,57 +969,624 @@ else {
 
 mvavg=integrated_volt/1000; // напряжение в mV
 
+rcu_read_lock();
+tbl=rcu_dereference(bat->cap);
 // если таблицы процентов не существует
-if (bat-> cap == 0) {
+if (tbl == 0) {
+  rcu_read_unlock();
   pr_err("Capacity convert table is NULL!\n");
   cap=-22;
   capupdate=1;
   goto nocap;
 }  
-// выход за границы таблицы
 
-else if  (mvavg < bat->cap[0].vmin)              cap=0;
-else if  (mvavg > bat->cap[bat->capsize-1].vmin) cap=100;
-else {
- // напряжение попадает внутрь таблицы - ищем строку таблицы
- for (i=0;i<bat->capsize;i++) {
-   if (bat->status == POWER_SUPPLY_STATUS_DISCHARGING) offset=0;
-   else offset=bat->cap[i].offset;
-   if (((mvavg+offset) > bat->cap[i].vmin) && ((mvavg+offset) <= bat->cap[i].vmax)) break;
- }
- //   смещение V от vmin        разность % между строками                       разность напряжений между строками
- bpr=(mvavg-bat->cap[i].vmin)*(bat->cap[i+1].percent-bat->cap[i].percent)*10/(bat->cap[i+1].vmin-bat->cap[i].vmin);
- cap=bpr/10;
- if ((bpr%10)>4) cap++;
- if (cap > bat->cap[i+1].percent) cap=bat->cap[i+1].percent;
-}
-
-// Провряем, не попадает ли напряжение на границу перехода процентов
+// данные цикла общие для всех способов оценки
+now=ktime_get_boottime();
+in.mv=volt/1000;
+in.mv_avg=mvavg;
+in.spread=bat->mon_spread/1000;
+in.ichg=(bat->status == POWER_SUPPLY_STATUS_CHARGING) ? bat->mon_ichg : 0;
+// вне разряда используется ветка кривой со смещением offset
+in.charging=(bat->status != POWER_SUPPLY_STATUS_DISCHARGING);
+in.dt=(ktime_to_ns(bat->soc_time) != 0) ? (int)ktime_ms_delta(now,bat->soc_time) : 0;
+in.design_mah=bat->design_mah;
+in.capacity=bat->capacity;
+in.curve=&tbl->curve;
+bat->soc_time=now;
+
+// все способы работают на одном потоке измерений, отображается выбранный
+for (i=0;i<BATTERY_SOC_COUNT;i++) est[i]=(*battery_core_soc_engines[i].estimate)(bat,&in,&upd[i]);
+cap=est[bat->soc_engine];
+capupdate=upd[bat->soc_engine];
+
 if (bat->test_mode != 0) capupdate=1;
-else {
-  capupdate=0;
-  for (i=bat->capsize-1;i>0;i++) {
-    if (bat->capacity > bat->cap[i-1].percent) break;
-  }
-  hyst=bat->cap[i].hysteresis;
-  if ((mvavg < (bat->cap[i].vmin-hyst)) || (mvavg > (bat->cap[i].vmax+hyst))) capupdate=1;
-}
+else if (bat->mon_fast_start != 0) {
+  // быстрый старт: сохраненная емкость точнее оценки по напряжению,
+  // если напряжение попадает в ее полосу гистерезиса
+  if ((saved >= 0) && (capacity_curve_changed(&tbl->curve,saved,mvavg) == 0)) cap=saved;
+  capupdate=1;
+  battery_soc_kalman_seed(&bat->kalman,cap);
+}  
+// в покое напряжение близко к OCV - привязываем к нему счетчик заряда
+if (rest) rebase=(bat->mon_fast_start != 0) ? cap : capacity_curve_percent(&tbl->curve,in.mv,in.charging);
+rcu_read_unlock();
 
 nocap:
 
 mutex_lock(&bat->lock);
 bat->volt_now=volt;
 bat->volt_avg=integrated_volt;
-if (capupdate) bat->capacity=cap;
+if (capupdate) {
+  // учет циклов: суммируется снижение емкости при разряде
+  if ((bat->mon_fast_start == 0) && (bat->test_mode == 0) && (bat->status == POWER_SUPPLY_STATUS_DISCHARGING) &&
+      (cap >= 0) && (cap < bat->capacity)) bat->cycle_pct+=bat->capacity-cap;
+  bat->capacity=cap;
+}  
+if (rebase >= 0) battery_counter_rebase(&bat->counter,rebase);
 mutex_unlock(&bat->lock);
 
 if (bat->debug_mode) {
   pr_info("vbat(meas/avg)=%dmV/%dmV, capacity(%d%%) has %s %s\n",bat->volt_now/1000,mvavg,
 	  bat->capacity,capupdate?"changed":"not changed",bat->test_mode?"at test mode":"");
 }  
+}
+
+//*****************************************************
+//*  Оценка скорости изменения напряжения
+//*****************************************************
+// Вызывается после каждого нового значения volt_avg. При смене статуса зарядки
+// скорость сбрасывается: подключение зарядника дает скачок, а не тренд.
+void battery_core_update_slope(struct battery_core_interface* bat) {
 
-no_vbat_proc:
+ktime_t now;
+int dt,slope;
 
+now=ktime_get_boottime();
+if ((bat->mon_prev_volt == 0) || (bat->mon_prev_status != bat->status)) bat->mon_slope=0;
+else {
+  dt=(int)ktime_ms_delta(now,bat->mon_prev_time);
+  if (dt > 0) {
+    slope=(int)div_s64((s64)(bat->volt_avg-bat->mon_prev_volt)*1000,dt);
+    bat->mon_slope=(bat->mon_slope*(BATTERY_MON_SLOPE_WEIGHT-1)+slope)/BATTERY_MON_SLOPE_WEIGHT;
+  }
+}
+bat->mon_prev_volt=bat->volt_avg;
+bat->mon_prev_time=now;
+bat->mon_prev_status=bat->status;
+}
+
+//*****************************************************
+//*  Выбор периода до следующего цикла монитора
+//*****************************************************
+// Период лежит между меньшим и большим из charging_monitor_period и
+// discharging_monitor_period. Стабильная батарея опрашивается с наибольшим периодом,
+// период сокращается при быстром изменении напряжения, приближении к low_volt
+// (ниже него и около poweroff_volt - наименьший период), приближении температуры
+// к порогам запрета зарядки, а также во время зарядки.
+int battery_core_monitor_period(struct battery_core_interface* bat) {
+
+int lo,hi,period,t,d;
+int slope,volt;
+
+lo=min(bat->chg_mon_period,bat->dischg_mon_period);
+hi=max(bat->chg_mon_period,bat->dischg_mon_period);
+if (lo < BATTERY_MON_PERIOD_FLOOR) lo=BATTERY_MON_PERIOD_FLOOR;
+if (hi < lo) hi=lo;
+period=hi;
+
+// зарядка: отслеживаем окончание заряда не реже середины диапазона
+if (bat->status == POWER_SUPPLY_STATUS_CHARGING) period=lo+(hi-lo)/2;
+
+// скорость изменения напряжения: не более BATTERY_MON_DV_STEP за период
+slope=abs(bat->mon_slope);
+if (slope > 0) {
+  t=(int)min_t(s64,div_s64((s64)BATTERY_MON_DV_STEP*1000,slope),hi);
+  if (t < period) period=t;
+}
+
+// приближение к low_volt и poweroff_volt при разряде
+if (bat->status == POWER_SUPPLY_STATUS_DISCHARGING) {
+  volt=bat->volt_avg/1000;
+  d=volt-bat->low_volt;
+  if ((d <= 0) || (volt <= bat->poweroff_volt)) period=lo;
+  else if (bat->mon_slope < 0) {
+    // время до low_volt при текущей скорости разряда, мс
+    t=(int)min_t(s64,div_s64((s64)d*1000000,-bat->mon_slope)/BATTERY_MON_APPROACH_DIV,hi);
+    if (t < period) period=t;
+  }
+}
+
+// приближение температуры к порогам запрета зарядки
+d=min(abs(bat->temp_dc-bat->temp_high_disable_charge*10),abs(bat->temp_dc-bat->temp_low_disable_charge*10));
+if (d < BATTERY_MON_TEMP_FAR) {
+  t=lo+(hi-lo)*d/BATTERY_MON_TEMP_FAR;
+  if (t < period) period=t;
+}
+
+if (period < lo) period=lo;
+if (period > hi) period=hi;
+return period;
+}
+
+//*****************************************************
+//*  Постановка очередного шага монитора в очередь
+//*****************************************************
+// Очередь и процессор выбираются по политике mon_place. Политика меняется только
+// между циклами, поэтому шаги одного цикла не попадают в разные пулы worker'ов.
+struct workqueue_struct* battery_core_monitor_queue(struct battery_core_interface* bat, int* cpu) {
+
+struct workqueue_struct* swq;
+
+swq=bat->mon_queue;
+if (swq == 0) swq=system_wq;
+switch (bat->mon_place) {
+  case BATTERY_MON_PLACE_UNBOUND:
+    swq=system_unbound_wq;
+    *cpu=WORK_CPU_UNBOUND;
+    break;
+    
+  case BATTERY_MON_PLACE_POWER_EFFICIENT:
+    swq=system_power_efficient_wq;
+    *cpu=WORK_CPU_UNBOUND;
+    break;
+    
+  case BATTERY_MON_PLACE_IRQ_CPU:
+    *cpu=bat->mon_irq_cpu;
+    break;
+    
+  default:
+    *cpu=bat->mon_cpu;
+}
+// выбранный процессор выключен - ставим на текущий
+if ((*cpu < 0) || (*cpu >= nr_cpu_ids) || !cpu_online(*cpu)) *cpu=WORK_CPU_UNBOUND;
+return swq;
+}
+
+//*****************************************************
+//*  Постановка отложенной работы монитора в очередь
+//*****************************************************
+void battery_core_monitor_queue_work(struct battery_core_interface* bat, struct delayed_work* dw, int delay) {
+
+struct workqueue_struct* swq;
+int cpu;
+
+swq=battery_core_monitor_queue(bat,&cpu);
+// mod, а не queue: новый срок всегда перекрывает ранее поставленный
+mod_delayed_work_on(cpu,swq,dw,msecs_to_jiffies(delay));
+}
+
+//*****************************************************
+//*  Постановка очередного шага монитора в очередь
+//*****************************************************
+// Шаги цикла идут по обычному таймеру: шаг цикла перекрывает и внеочередной
+// запуск, поставленный событием зарядника в момент старта цикла
+void battery_core_monitor_schedule(struct battery_core_interface* bat, int state, int delay) {
+
+bat->mon_state=state;
+battery_core_monitor_queue_work(bat,&bat->work,delay);
+}
+
+//*****************************************************
+//*  Имена политик размещения work монитора
+//*****************************************************
+static const char* battery_core_placement_names[BATTERY_MON_PLACE_COUNT]={
+  "pinned",
+  "unbound",
+  "power-efficient",
+  "irq-cpu"
+};
+
+int battery_core_parse_placement(const char* name) {
+
+int i;
+
+for (i=0;i<BATTERY_MON_PLACE_COUNT;i++) {
+  if (sysfs_streq(name,battery_core_placement_names[i])) return i;
+}
+return -EINVAL;
+}
+
+//*****************************************************
+//*  Внеочередной запуск цикла монитора
+//*****************************************************
+// Вызывается под mon_lock. Если монитор ждет следующего цикла, цикл переносится
+// на BATTERY_MON_KICK_DELAY по обычному таймеру, и каждый новый запуск в этом окне
+// лишь отодвигает его. Если цикл уже идет - ничего не делаем.
+void battery_core_monitor_kick(struct battery_core_interface* bat) {
+
+if ((bat->mon_busy != 0) || (bat->mon_stopped != 0)) return;
+__pm_stay_awake(&bat->ws);
+// плановый запуск больше не нужен
+cancel_delayed_work(&bat->idle_work);
+bat->mon_place=bat->mon_placement;
+battery_core_monitor_schedule(bat,BATTERY_MON_TEMP,BATTERY_MON_KICK_DELAY);
+}
+
+//*****************************************************
+//*  Внеочередной запуск монитора по событию зарядника
+//*****************************************************
+// Вызывается из обработчиков прерываний зарядника через charger_core.
+// Если цикл уже идет, событие запоминается и следующий цикл начнется сразу после текущего.
+void battery_core_charger_event(void* data, unsigned int events) {
+
+struct battery_core_interface* bat=data;
+unsigned long flags;
+
+spin_lock_irqsave(&bat->mon_lock,flags);
+bat->mon_events|=events;
+bat->mon_irq_cpu=raw_smp_processor_id();
+battery_core_monitor_kick(bat);
+spin_unlock_irqrestore(&bat->mon_lock,flags);
+}
+
+//*****************************************************
+//*  Проверка близости к порогам отключения
+//*****************************************************
+// volt - напряжение, мВ, temp - температура, 0.1 C.
+// Возвращает 1, если батарея разряжена до low_volt или температура ближе
+// BATTERY_MON_TEMP_FAR к порогам отключения питания.
+int battery_core_monitor_critical(struct battery_core_interface* bat, int volt, int temp) {
+
+if ((bat->status == POWER_SUPPLY_STATUS_DISCHARGING) && (volt > 0) && (volt <= bat->low_volt)) return 1;
+if (temp >= bat->temp_high_poweroff*10-BATTERY_MON_TEMP_FAR) return 1;
+if (temp <= bat->temp_low_poweroff*10+BATTERY_MON_TEMP_FAR) return 1;
+return 0;
+}
+
+//*****************************************************
+//*  Жесткий срок проверки безопасности
+//*****************************************************
+int battery_core_safety_period(struct battery_core_interface* bat) {
+
+int period;
+
+period=max(bat->chg_mon_period,bat->dischg_mon_period)*BATTERY_MON_SAFETY_MULT;
+if (period < BATTERY_MON_PERIOD_FLOOR) period=BATTERY_MON_PERIOD_FLOOR;
+return period;
+}
+
+//*****************************************************
+//*  Плановый запуск цикла монитора
+//*****************************************************
+// Срабатывает по отложенному (deferrable) таймеру: на простаивающей системе
+// таймер ждет ближайшего пробуждения по другой причине и сам ее не будит.
+void battery_core_monitor_idle_work(struct work_struct *work) {
+
+struct delayed_work* dw=container_of(work, struct delayed_work, work);
+struct battery_core_interface* bat=container_of(dw, struct battery_core_interface, idle_work);
+unsigned long flags;
+
+spin_lock_irqsave(&bat->mon_lock,flags);
+if ((bat->mon_busy == 0) && (bat->mon_stopped == 0)) {
+  __pm_stay_awake(&bat->ws);
+  battery_core_monitor_schedule(bat,BATTERY_MON_TEMP,0);
+}  
+spin_unlock_irqrestore(&bat->mon_lock,flags);
+}
+
+//*****************************************************
+//*  Проверка безопасности по жесткому сроку
+//*****************************************************
+// Срабатывает по обычному таймеру, если за safety-период не завершился ни один цикл
+// (плановые циклы отложены простоем системы). Делается одна быстрая выборка
+// напряжения и температуры без остановки зарядки; при приближении к порогам
+// отключения запускается полный цикл, иначе проверка переносится на следующий срок.
+void battery_core_monitor_safety_work(struct work_struct *work) {
+
+struct delayed_work* dw=container_of(work, struct delayed_work, work);
+struct battery_core_interface* bat=container_of(dw, struct battery_core_interface, safety_work);
+struct battery_interface* api;
+int vbat,vntc,volt,temp;
+unsigned long flags;
+
+api=bat->api;
+volt=0;
+temp=bat->temp_dc;
+if ((api->get_vbat_proc != 0) && ((*api->get_vbat_proc)(api,&vbat) == 0)) volt=vbat/1000;
+if ((api->get_vntc_proc != 0) && ((*api->get_vntc_proc)(api,&vntc) == 0)) temp=battery_core_vntc_to_temp(bat,vntc);
+
+spin_lock_irqsave(&bat->mon_lock,flags);
+if (battery_core_monitor_critical(bat,volt,temp)) {
+  pr_info("safety check: vbat=%dmV temp=%d(0.1C), running monitor cycle\n",volt,temp);
+  battery_core_monitor_kick(bat);
+}
+else if (bat->mon_stopped == 0) battery_core_monitor_queue_work(bat,&bat->safety_work,battery_core_safety_period(bat));
+spin_unlock_irqrestore(&bat->mon_lock,flags);
+}
+
+//*****************************************************
+//*  Запрет постановки работ монитора в очередь
+//*****************************************************
+// После вызова работы монитора больше не ставят друг друга в очередь,
+// и их можно отменять в любом порядке.
+void battery_core_monitor_stop(struct battery_core_interface* bat) {
+
+unsigned long flags;
+
+spin_lock_irqsave(&bat->mon_lock,flags);
+bat->mon_stopped=1;
+spin_unlock_irqrestore(&bat->mon_lock,flags);
+}
+
+//*****************************************************
+//*  Пакетное измерение канала АЦП за один шаг монитора
+//*****************************************************
+// vbat=1 - напряжение аккумулятора, мкВ, 0 - напряжение NTC. Все выборки
+// mon_samples делаются одним запросом get_adc_batch_proc; драйвер без пакетного
+// чтения дает одну выборку. spread (может быть 0) - разброс выборок, 0 - неизвестен.
+// -ENODEV - канал драйвером не поддерживается.
+int battery_core_read_adc(struct battery_core_interface* bat, int vbat, int* val, int* spread) {
+
+struct battery_interface* api=bat->api;
+int (*single)(struct battery_interface*, int*);
+
+single=(vbat != 0) ? api->get_vbat_proc : api->get_vntc_proc;
+if (spread != 0) *spread=0;
+if (single == 0) return -ENODEV;
+if (api->get_adc_batch_proc != 0)
+  return (*api->get_adc_batch_proc)(api,(vbat != 0) ? api->vbat : api->tbat,bat->mon_samples,val,spread);
+return (*single)(api,val);
+}
+
+//*****************************************************
+//*  Однократное измерение напряжения аккумулятора, мкВ
+//*****************************************************
+// Используется вне конечного автомата, когда нужна одна выборка без пауз
+int battery_core_sample_vbat(struct battery_core_interface* bat, int* uv) {
+
+struct battery_interface* api=bat->api;
+
+if ((api->get_adc_batch_proc != 0) && (api-> get_vbat_proc != 0)) 
+  return (*api->get_adc_batch_proc)(api,api->vbat,BATTERY_MON_SAMPLES,uv,0);
+if (api-> get_vbat_proc != 0) return (*api-> get_vbat_proc)(api,uv);
+return -ENODEV;
+}
+
+//*****************************************************
+//*  Выбор способа измерения напряжения при зарядке
+//*****************************************************
+// Возвращает 1, если в этом цикле напряжение измеряется под нагрузкой с
+// компенсацией ichg*R, и 0, если зарядку надо приостановить. Пауза остается
+// раз в ir_learn_cycles циклов - по ней уточняется сопротивление.
+int battery_core_ir_comp_cycle(struct battery_core_interface* bat, int ichg) {
+
+if ((bat->ir_comp == 0) || (bat->mon_fast_start != 0) || (bat->ir_mohm <= 0)) return 0;
+if ((bat->status != POWER_SUPPLY_STATUS_CHARGING) || (ichg < BATTERY_IR_MIN_CURRENT)) return 0;
+if (bat->mon_ir_count >= bat->ir_learn_cycles) return 0;
+bat->mon_ir_count++;
+return 1;
+}
+
+//*****************************************************
+//*  Сопротивление для текущей температуры
+//*****************************************************
+void battery_core_ir_refresh(struct battery_core_interface* bat) {
+
+int r;
+
+r=battery_ir_value(&bat->irest,bat->temp_dc);
+if (r <= 0) return;
+mutex_lock(&bat->lock);
+bat->ir_mohm=r;
+mutex_unlock(&bat->lock);
+}
+
+//*****************************************************
+//*  Длительность стабилизации напряжения после остановки зарядки, мс
+//*****************************************************
+int battery_core_settle_delay(struct battery_core_interface* bat) {
+
+return (bat->mon_burst != 0) ? BATTERY_MON_FAST_SETTLE_DELAY : BATTERY_MON_SETTLE_DELAY;
+}
+
+//*****************************************************
+//*  Уточнение внутреннего сопротивления по паузе зарядки
+//*****************************************************
+// vrest - напряжение через BATTERY_IR_SAMPLE_DELAY после остановки зарядки, мкВ,
+// независимо от длительности стабилизации цикла. Скачок тока известен:
+// от mon_ichg до 0, так что R=(Vload-Vrest)/Ichg (мкВ/мА = мОм).
+void battery_core_ir_learn(struct battery_core_interface* bat, int vrest) {
+
+int r;
+
+if ((bat->mon_vload == 0) || (bat->mon_ichg < BATTERY_IR_MIN_CURRENT)) return;
+r=battery_ir_update(&bat->irest,bat->temp_dc,bat->mon_vload-vrest,bat->mon_ichg);
+bat->mon_vload=0;
+if (r < 0) {
+  if (bat->debug_mode) pr_info("implausible internal resistance step ignored\n");
+  return;
+}
+battery_core_ir_refresh(bat);
+bat->mon_ir_count=0;
+if (bat->debug_mode) pr_info("internal resistance %dmOhm at %ddC (step %dmOhm at %dmA)\n",
+      bat->ir_mohm,bat->temp_dc,r,bat->mon_ichg);
+}
+
+
+//*****************************************************
+//*  Остановка монитора перед suspend
+//*****************************************************
+// Снимает все работы монитора; если цикл прерван посреди измерения -
+// возвращает зарядку. Запоминает момент ухода в сон.
+int battery_core_timer_suspend(struct battery_core_interface* bat) {
+
+struct charger_interface* capi;
+struct charger_core_interface* chg;
+unsigned long flags;
+
+battery_core_monitor_stop(bat);
+cancel_delayed_work_sync(&bat->idle_work);
+cancel_delayed_work_sync(&bat->safety_work);
+cancel_delayed_work_sync(&bat->work);
+
+chg=battery_core_get_charger(bat);
+if ((bat->mon_chg_suspended != 0) && (chg != 0)) {
+  capi=chg->api;
+  if (capi->resume_charging != 0) (*capi->resume_charging)(capi);
+}
+charger_core_put(chg);
+bat->mon_chg_suspended=0;
+
+spin_lock_irqsave(&bat->mon_lock,flags);
+bat->mon_busy=0;
+bat->mon_state=BATTERY_MON_TEMP;
+if (bat->ws.active != 0) __pm_relax(&bat->ws);
+spin_unlock_irqrestore(&bat->mon_lock,flags);
+
+bat->suspend_time=ktime_get_boottime();
+// на время сна счетчик заряда переходит на ток сна
+bat->counter_sleeping=1;
+battery_core_publish(bat);
+return 0;
+}
+
+//*****************************************************
+//*  Запуск монитора после resume
+//*****************************************************
+// Сразу запускает полный цикл - как при быстром старте, пакетом выборок с короткой
+// стабилизацией. Если спали дольше BATTERY_RESUME_RESEED_MIN, первая выборка
+// переинициализирует интегратор с весом slept/(slept+TAU), чтобы емкость сразу
+// соответствовала напряжению после сна.
+int battery_core_timer_resume(struct battery_core_interface* bat) {
+
+s64 slept;
+unsigned long flags;
+
+slept=ktime_ms_delta(ktime_get_boottime(),bat->suspend_time);
+if (slept >= BATTERY_RESUME_RESEED_MIN) 
+  bat->mon_reseed_weight=(int)div64_s64(slept<<BATTERY_FILTER_SHIFT,slept+BATTERY_RESUME_RESEED_TAU);
+else bat->mon_reseed_weight=0;  
+bat->counter_sleeping=0;
+battery_core_publish(bat);
+
+spin_lock_irqsave(&bat->mon_lock,flags);
+bat->mon_stopped=0;
+bat->mon_burst=1;
+__pm_stay_awake(&bat->ws);
+bat->mon_place=bat->mon_placement;
+battery_core_monitor_schedule(bat,BATTERY_MON_TEMP,0);
+spin_unlock_irqrestore(&bat->mon_lock,flags);
+
+if (bat->debug_mode) pr_info("resumed after %lldms, integrator reseed weight %d/%d\n",
+       slept,bat->mon_reseed_weight,1<<BATTERY_FILTER_SHIFT);
+return 0;
+}
+
+//*****************************************************
+//*  Монитор состояния батареи
+//*****************************************************
+// Монитор работает как конечный автомат: пакет выборок NTC, выборка vbat сразу
+// после остановки зарядки (для оценки сопротивления), ожидание стабилизации
+// напряжения и пакет выборок vbat - отдельные шаги, между шагами work снимается с
+// процессора и ставится в очередь заново, так что процессор может спать, а не
+// крутиться в udelay.
+// chg - зарядник со взятой на время шага ссылкой или 0
+void battery_core_monitor_cycle(struct battery_core_interface* bat, struct charger_core_interface* chg) {
+  
+struct battery_interface* api;
+struct charger_interface* capi;
+int rc;
+int volt,vntc,vrest;
+int new_status;  // R6
+int current_max;
+int monperiod;
+unsigned int events;
+unsigned long flags;
+
+if (!bat->ws.active) __pm_stay_awake(&bat->ws);
+api=bat->api;
+
+// начало цикла: события зарядника, пришедшие до этого момента, цикл и обработает
+if (bat->mon_state == BATTERY_MON_TEMP) {
+  spin_lock_irqsave(&bat->mon_lock,flags);
+  bat->mon_busy=1;
+  cancel_delayed_work(&bat->idle_work);
+  events=bat->mon_events;
+  bat->mon_events=0;
+  spin_unlock_irqrestore(&bat->mon_lock,flags);
+  // первый цикл после регистрации или resume измеряет пакетом большего размера
+  if (bat->mon_burst != 0) bat->mon_samples=BATTERY_MON_BURST_SAMPLES;
+  else bat->mon_samples=BATTERY_MON_SAMPLES;
+  if ((events != 0) && (bat->debug_mode)) pr_info("monitor cycle kicked by charger events 0x%02x\n",events);
+}  
+// пока новое напряжение не измерено - работаем с последним известным
+volt=bat->volt_now;
+
+// шаги TEMP и IR либо ставят следующий шаг и выходят, либо (зарядка не
+// приостанавливалась) сразу переходят к измерению vbat, как и шаг SETTLE
+switch (bat->mon_state) {
+  case BATTERY_MON_IR:
+    // напряжение сразу после паузы зарядки - уточняем сопротивление
+    if (battery_core_sample_vbat(bat,&vrest) == 0) battery_core_ir_learn(bat,vrest);
+    bat->mon_vload=0;
+    // остаток стабилизации - до прежнего срока измерения vbat
+    battery_core_monitor_schedule(bat,BATTERY_MON_SETTLE,
+      max(battery_core_settle_delay(bat)-BATTERY_IR_SAMPLE_DELAY,0));
+    return;
+
+  case BATTERY_MON_TEMP:
+    // все выборки температуры одним пакетным запросом с аппаратным усреднением
+    rc=battery_core_read_adc(bat,0,&vntc,0);
+    if (rc == 0) battery_core_update_temp(bat,vntc);
+    else if (rc != -ENODEV) pr_err("failed to measure battery temperature, rc=%d\n",rc);
+
+    // Температуру измерили, теперь измеряем напряжение
+    // приостанавливаем зарядку и ждем стабилизации напряжения на батарее
+    battery_core_ir_refresh(bat);
+    bat->mon_ir_comp=0;
+    bat->mon_vload=0;
+    if (chg == 0) break;
+    capi=chg->api;
+    bat->mon_ichg=0;
+    if (capi->get_charging_current != 0) (*capi->get_charging_current)(capi,&bat->mon_ichg);
+    // режим компенсации: измеряем не останавливая зарядку
+    if (battery_core_ir_comp_cycle(bat,bat->mon_ichg)) {
+      bat->mon_ir_comp=1;
+      bat->pause_saved_ms+=BATTERY_MON_SETTLE_DELAY;
+      break;
+    }
+    // напряжение под нагрузкой перед паузой - для оценки сопротивления
+    if ((bat->status == POWER_SUPPLY_STATUS_CHARGING) && (bat->mon_ichg >= BATTERY_IR_MIN_CURRENT) && 
+        (battery_core_sample_vbat(bat,&bat->mon_vload) != 0)) bat->mon_vload=0;
+    if ((capi->suspend_charging != 0) && ((*capi->suspend_charging)(capi) == 0)) {
+      bat->mon_chg_suspended=1;
+      // скачок напряжения для оценки сопротивления снимаем сразу, пока не
+      // началась релаксация, и с одной задержкой в любом цикле
+      if (bat->mon_vload != 0) battery_core_monitor_schedule(bat,BATTERY_MON_IR,BATTERY_IR_SAMPLE_DELAY);
+      else battery_core_monitor_schedule(bat,BATTERY_MON_SETTLE,battery_core_settle_delay(bat));
+      return;
+    }
+    // зарядка не приостанавливалась - ждать нечего
+    bat->mon_vload=0;
+    break;
+
+  case BATTERY_MON_SETTLE:
+    break;
+}
+
+// все выборки напряжения одним пакетным запросом
+rc=battery_core_read_adc(bat,1,&volt,&bat->mon_spread);
+if (rc == 0) {
+  // под нагрузкой: вычитаем падение на внутреннем сопротивлении (мА*мОм = мкВ)
+  if (bat->mon_ir_comp != 0) volt-=bat->mon_ichg*bat->ir_mohm;
+  // в тестовом режиме берем установленное напряжение вместо измеренного
+  if (bat->test_mode != 0) volt=bat->volt_now;
+  battery_core_update_vbat(bat,volt);
+  battery_core_update_slope(bat);
+  bat->mon_fast_start=0;
+  bat->mon_burst=0;
+}
+else {
+  if (rc != -ENODEV) pr_err("failed to measure battery voltage, rc=%d\n",rc);
+  volt=bat->volt_now;
+}
+
+// возобновляем зарядку
+if ((bat->mon_chg_suspended != 0) && (chg != 0)) {
+  capi=chg->api;
+  if (capi->resume_charging != 0) (*capi->resume_charging)(capi);
+}
+bat->mon_chg_suspended=0;
 
 volt/=1000;
 new_status=bat->status;
@@ -665,37 +1631,254 @@ switch (bat->status) {
     new_status=POWER_SUPPLY_STATUS_UNKNOWN;
 }
 
-//  сообщаем заряднику о текущем ограничении зарядного тока
-if (bat->charger != 0) {
-  capi=bat->charger->api;
-  current_max=bat->current_max;
+//  сообщаем заряднику о текущем ограничении зарядного тока;
+//  событие только ставится в очередь зарядника, монитор не ждет обмена с ним
+if (chg != 0) {
+  capi=chg->api;
+  current_max=bat->current_max/1000;   // событие 4 принимает мА
   if (capi->notify_event != 0) (*capi->notify_event)(capi,4,&current_max);
 }
 
 
 
+// результаты цикла становятся видны читателям одной публикацией
+battery_core_publish(bat);
+if ((bat->state != 0) && (ktime_ms_delta(ktime_get_boottime(),bat->state_time) >= BATTERY_STATE_SAVE_PERIOD)) 
+  battery_core_state_store(bat);
 if (new_status>3) battery_core_external_power_changed(&bat->psy);
-if (bat->status == POWER_SUPPLY_STATUS_DISCHARGING) monperiod=bat->dischg_mon_period;
-    else monperiod=bat->chg_mon_period;
-queue_delayed_work_on(1,bat->mon_queue,&bat->work ,msecs_to_jiffies(monperiod));
-if (bat->ws.active != 0) __pm_relax(&bat->ws);
+monperiod=battery_core_monitor_period(bat);
+bat->mon_period=monperiod;
+if (bat->debug_mode) pr_info("next monitor cycle in %dms, dV/dt=%duV/s\n",monperiod,bat->mon_slope);
+// цикл закончен, следующий начинаем с выборок температуры    
+spin_lock_irqsave(&bat->mon_lock,flags);
+bat->mon_busy=0;
+// новая политика размещения вступает в силу со следующего цикла
+bat->mon_place=bat->mon_placement;
+bat->mon_state=BATTERY_MON_TEMP;
+if (bat->mon_stopped == 0) {
+  // за время цикла пришли события зарядника - следующий цикл сразу
+  if (bat->mon_events != 0) battery_core_monitor_schedule(bat,BATTERY_MON_TEMP,BATTERY_MON_KICK_DELAY);
+  // рядом с порогами отключения - цикл по обычному таймеру
+  else if (battery_core_monitor_critical(bat,bat->volt_avg/1000,bat->temp_dc)) 
+    battery_core_monitor_schedule(bat,BATTERY_MON_TEMP,monperiod);
+  // плановый цикл - по отложенному таймеру
+  else battery_core_monitor_queue_work(bat,&bat->idle_work,monperiod);
+  // жесткий срок проверки безопасности отсчитывается от конца цикла
+  battery_core_monitor_queue_work(bat,&bat->safety_work,battery_core_safety_period(bat));
+}  
+// отпускаем wakeup source под блокировкой, чтобы не снять удержание,
+// взятое следующим событием зарядника
+if ((bat->mon_events == 0) && (bat->ws.active != 0)) __pm_relax(&bat->ws);
+spin_unlock_irqrestore(&bat->mon_lock,flags);
+}
+
+void battery_core_monitor_work(struct work_struct *work) {
+
+struct delayed_work* dw=container_of(work, struct delayed_work, work);
+struct battery_core_interface* bat=container_of(dw, struct battery_core_interface, work);  
+struct charger_core_interface* chg;
+
+chg=battery_core_get_charger(bat);
+battery_core_monitor_cycle(bat,chg);
+charger_core_put(chg);
 }
 
 
+//*****************************************************
+//*  Установка таблицы температур NTC
+//*****************************************************
+// Таблица поиска и множитель калибровки vref строятся сразу при установке,
+// чтобы монитор не просматривал исходную таблицу и не делил на каждом цикле.
+// Новая таблица публикуется через RCU, старая освобождается после периода RCU.
+int battery_core_load_ntc_table(struct battery_core_interface* bat, const struct ntc_tvm* ntc, int size, int vref, int vref_calib) {
+
+int rc;
+struct battery_ntc_table* tbl;
+struct battery_ntc_table* old;
+
+if ((size <= 0) || (size > NTC_LOOKUP_MAX_ROWS)) return -EINVAL;
+if ((vref <= 0) || (vref_calib <= 0)) return -EINVAL;
+tbl=kzalloc(sizeof(struct battery_ntc_table),GFP_KERNEL);
+if (tbl == 0) return -ENOMEM;
+
+memcpy(tbl->rows,ntc,size*sizeof(struct ntc_tvm));
+tbl->size=size;
+rc=ntc_lookup_build(&tbl->lookup,tbl->rows,size);
+if (rc != 0) {
+  pr_err("invalid NTC convert table, rc=%d\n",rc);
+  kfree(tbl);
+  return rc;
+}
+tbl->vref=vref;
+tbl->vref_calib=vref_calib;
+if (vref != vref_calib) tbl->calib_scale=div_s64((s64)vref_calib<<BATTERY_NTC_CALIB_SHIFT,vref);
+else tbl->calib_scale=0;
+
+mutex_lock(&bat->tbl_lock);
+old=rcu_dereference_protected(bat->ntc,lockdep_is_held(&bat->tbl_lock));
+rcu_assign_pointer(bat->ntc,tbl);
+mutex_unlock(&bat->tbl_lock);
+if (old != 0) kfree_rcu(old,rcu);
+return 0;
+}
+
+//*****************************************************
+//* Установка таблицы емкостей аккумулятора
+//*****************************************************
+// Строит новую таблицу из строк cap и публикует ее через RCU.
+// Монитор читает таблицу под rcu_read_lock и никогда не ждет замены.
+int battery_core_load_capacity_table(struct battery_core_interface* bat, const struct capacity* cap, int size) {
+
+int rc;
+struct battery_capacity_table* tbl;
+struct battery_capacity_table* old;
+
+if ((size <= 0) || (size > CAPACITY_CURVE_MAX_ROWS)) return -EINVAL;
+tbl=kzalloc(sizeof(struct battery_capacity_table),GFP_KERNEL);
+if (tbl == 0) return -ENOMEM;
+
+memcpy(tbl->rows,cap,size*sizeof(struct capacity));
+tbl->size=size;
+rc=capacity_curve_build(&tbl->curve,tbl->rows,size);
+if (rc != 0) {
+  pr_err("invalid capacity convert table, rc=%d\n",rc);
+  kfree(tbl);
+  return rc;
+}
+
+mutex_lock(&bat->tbl_lock);
+old=rcu_dereference_protected(bat->cap,lockdep_is_held(&bat->tbl_lock));
+rcu_assign_pointer(bat->cap,tbl);
+mutex_unlock(&bat->tbl_lock);
+if (old != 0) kfree_rcu(old,rcu);
+return 0;
+}
+
 //*****************************************************
 //* Модификация таблицы емкостей аккумулятора
 //*****************************************************
+// Формат совпадает с выводом battery_show_property:
+//   percentage:min,max,offset,hysteresis     - необязательная строка заголовка
+//   <percent>%:<vmin>,<vmax>,<offset>,<hysteresis>
+// по одной строке таблицы на строку текста, знак % можно опускать.
 int battery_core_set_battery_capacity_tables(struct battery_core_interface* bat,const char* buf,size_t count) {
-  // пока заглушка
-  return 0;
+
+char* text;
+char* p;
+char* line;
+struct capacity* rows;
+struct capacity* r;
+int size,rc;
+
+text=kstrndup(buf,count,GFP_KERNEL);
+if (text == 0) return -ENOMEM;
+rows=kcalloc(CAPACITY_CURVE_MAX_ROWS,sizeof(struct capacity),GFP_KERNEL);
+if (rows == 0) {
+  kfree(text);
+  return -ENOMEM;
+}
+
+size=0;
+rc=0;
+p=text;
+while ((line=strsep(&p,"\n")) != 0) {
+  line=strim(line);
+  if (line[0] == 0) continue;
+  // заголовок таблицы
+  if ((size == 0) && (strncmp(line,"percentage:",11) == 0)) continue;
+  if (size >= CAPACITY_CURVE_MAX_ROWS) {
+    rc=-E2BIG;
+    break;
+  }
+  r=&rows[size];
+  if ((sscanf(line,"%d%%:%d,%d,%d,%d",&r->percent,&r->vmin,&r->vmax,&r->offset,&r->hysteresis) != 5) &&
+      (sscanf(line,"%d:%d,%d,%d,%d",&r->percent,&r->vmin,&r->vmax,&r->offset,&r->hysteresis) != 5)) {
+    pr_err("bad capacity table line: %s\n",line);
+    rc=-EINVAL;
+    break;
+  }
+  size++;
+}
+if ((rc == 0) && (size < 2)) rc=-EINVAL;
+if (rc == 0) rc=battery_core_load_capacity_table(bat,rows,size);
+
+kfree(rows);
+kfree(text);
+return rc;
 }  
 
 //*****************************************************
 //* Модификация таблицы ткмператур
 //*****************************************************
+// Формат совпадает с выводом battery_show_property:
+//   vref=<uV>, vref_calib=<uV>, ntc_table[<n>]:   - необязательная строка заголовка
+//   <tempC>C:<uV>
+// по одной строке таблицы на строку текста. Без заголовка сохраняется текущая
+// калибровка vref; если в заголовке указан размер, он должен совпасть с числом строк.
 int battery_core_set_battery_ntc_tables(struct battery_core_interface* bat,const char* buf,size_t count) {
-  // пока заглушка
-  return 0;
+
+char* text;
+char* p;
+char* line;
+struct ntc_tvm* rows;
+struct battery_ntc_table* cur;
+int size,rc;
+int vref,vref_calib,hsize,nhdr;
+
+text=kstrndup(buf,count,GFP_KERNEL);
+if (text == 0) return -ENOMEM;
+rows=kcalloc(NTC_LOOKUP_MAX_ROWS,sizeof(struct ntc_tvm),GFP_KERNEL);
+if (rows == 0) {
+  kfree(text);
+  return -ENOMEM;
+}
+
+// по умолчанию калибровка берется из текущей таблицы
+vref=ntc_table_vref;
+vref_calib=ntc_table_vref;
+rcu_read_lock();
+cur=rcu_dereference(bat->ntc);
+if (cur != 0) {
+  vref=cur->vref;
+  vref_calib=cur->vref_calib;
+}
+rcu_read_unlock();
+
+size=0;
+rc=0;
+hsize=-1;
+p=text;
+while ((line=strsep(&p,"\n")) != 0) {
+  line=strim(line);
+  if (line[0] == 0) continue;
+  // заголовок таблицы
+  if ((size == 0) && (strncmp(line,"vref=",5) == 0)) {
+    nhdr=sscanf(line,"vref=%d, vref_calib=%d, ntc_table[%d]:",&vref,&vref_calib,&hsize);
+    if (nhdr < 2) {
+      pr_err("bad NTC table header: %s\n",line);
+      rc=-EINVAL;
+      break;
+    }
+    continue;
+  }  
+  if (size >= NTC_LOOKUP_MAX_ROWS) {
+    rc=-E2BIG;
+    break;
+  }
+  if (sscanf(line,"%dC:%d",&rows[size].tntc,&rows[size].tnvc) != 2) {
+    pr_err("bad NTC table line: %s\n",line);
+    rc=-EINVAL;
+    break;
+  }
+  size++;
+}
+if ((rc == 0) && (size < 2)) rc=-EINVAL;
+if ((rc == 0) && (hsize >= 0) && (hsize != size)) rc=-EINVAL;
+if (rc == 0) rc=battery_core_load_ntc_table(bat,rows,size,vref,vref_calib);
+
+kfree(rows);
+kfree(text);
+return rc;
 }  
 
 //*****************************************************
@@ -708,14 +1891,15 @@ struct battery_core_interface* bat;
 long int res=0;
 int off;
 int rc;
+int active,sleep;
 
 psy=dev_get_drvdata(dev);
 bat=container_of(psy, struct battery_core_interface, psy);  
 
 off=((unsigned int)attr-(unsigned int)battery_dev_attrs)/16;
 
-// Для всех атрибутов кроме 0 и 1 аргумент в буфере - число
-if (off>1) {
+// Для всех атрибутов кроме 0, 1, 22, 28 и 29 аргумент в буфере - число
+if ((off>1) && (off != 22) && (off != 28) && (off != 29)) {
   rc=kstrtol(buf,10,&res);
   if (rc != 0) return rc;
 }
@@ -828,6 +2012,60 @@ switch(off) {
     // debug_mode
     bat->debug_mode=res;
     break;
+    
+  case 21:
+    // generation - только чтение
+    return -EPERM;
+    
+  case 22:
+    // monitor_placement
+    rc=battery_core_parse_placement(buf);
+    if (rc < 0) return rc;
+    bat->mon_placement=rc;
+    break;
+    
+  case 23:
+    // monitor_cpu
+    if ((res < 0) || (res >= nr_cpu_ids)) return -EINVAL;
+    bat->mon_cpu=res;
+    break;
+    
+  case 24:
+    // cycle_count - только чтение
+    return -EPERM;
+    
+  case 25:
+    // ir_compensation
+    bat->ir_comp=(res != 0);
+    break;
+    
+  case 26:
+    // pause_saved_ms - только чтение
+    return -EPERM;
+    
+  case 27:
+    // internal_resistance - только чтение
+    return -EPERM;
+    
+  case 28:
+    // soc_engine
+    rc=battery_core_parse_soc_engine(buf);
+    if (rc < 0) return rc;
+    // счетчику заряда нужна емкость аккумулятора
+    if ((rc == BATTERY_SOC_COUNTER) && (bat->design_mah <= 0)) return -EINVAL;
+    bat->soc_engine=rc;
+    break;
+    
+  case 29:
+    // load_model: ток разряда без зарядки и в suspend, мА
+    if (sscanf(buf,"%d %d",&active,&sleep) != 2) return -EINVAL;
+    if ((active < 0) || (sleep < 0)) return -EINVAL;
+    mutex_lock(&bat->lock);
+    bat->load_active_ma=active;
+    bat->load_sleep_ma=sleep;
+    mutex_unlock(&bat->lock);
+    battery_core_publish(bat);
+    break;
 }    
 return count;
 }
@@ -842,6 +2080,9 @@ struct battery_core_interface* bat;
 int i,res,count;
 unsigned int off;
 char* head_c="percentage:min,max,offset,hysteresis\n";
+struct battery_capacity_table* tbl;
+struct battery_ntc_table* ntbl;
+struct battery_core_snapshot snap;
 
 
 psy=dev_get_drvdata(dev);
@@ -851,32 +2092,40 @@ off=((unsigned int)attr-(unsigned int)battery_dev_attrs)/16;
 switch(off) {
   case 0:
     // capacity
-    if (bat->cap == 0) {
+    rcu_read_lock();
+    tbl=rcu_dereference(bat->cap);
+    if (tbl == 0) {
+      rcu_read_unlock();
       res=0;
       break;
     }
     strcpy(buf,head_c);
     count=strlen(head_c);
-    for(i=0;i<bat->capsize;i++) {
+    for(i=0;i<tbl->size;i++) {
       count+=sprintf(buf+count,"%d%%:%d,%d,%d,%d\n",
-          bat->cap[i].percent,
-          bat->cap[i].vmin,
-          bat->cap[i].vmax,
-          bat->cap[i].offset,
-          bat->cap[i].hysteresis);
+          tbl->rows[i].percent,
+          tbl->rows[i].vmin,
+          tbl->rows[i].vmax,
+          tbl->rows[i].offset,
+          tbl->rows[i].hysteresis);
     }
+    rcu_read_unlock();
     return count;
     
   case 1:
     // ntc
-    if (bat->ntc == 0) {
+    rcu_read_lock();
+    ntbl=rcu_dereference(bat->ntc);
+    if (ntbl == 0) {
+      rcu_read_unlock();
       res=0;
       break;
     }
-    count=sprintf(buf,"vref=%d, vref_calib=%d, ntc_table[%d]:\n",bat->vref,bat->vref_calib,bat->ntcsize);
-    for(i=0;i<bat->ntcsize;i++) {
-      count+=sprintf(buf+count,"%dC:%d\n",bat->ntc[i].tntc,bat->ntc[i].tnvc);
+    count=sprintf(buf,"vref=%d, vref_calib=%d, ntc_table[%d]:\n",ntbl->vref,ntbl->vref_calib,ntbl->size);
+    for(i=0;i<ntbl->size;i++) {
+      count+=sprintf(buf+count,"%dC:%d\n",ntbl->rows[i].tntc,ntbl->rows[i].tnvc);
     }
+    rcu_read_unlock();
     return count;
     
   case 2:
@@ -973,6 +2222,49 @@ switch(off) {
     // debug_mode
     res=bat->debug_mode;
     break;
+    
+  case 21:
+    // generation
+    battery_core_read_snapshot(bat,&snap);
+    return sprintf(buf,"%u\n",snap.generation);
+    
+  case 22:
+    // monitor_placement
+    return sprintf(buf,"%s\n",battery_core_placement_names[bat->mon_placement]);
+    
+  case 23:
+    // monitor_cpu
+    res=bat->mon_cpu;
+    break;
+    
+  case 24:
+    // cycle_count
+    res=bat->cycle_pct/100;
+    break;
+    
+  case 25:
+    // ir_compensation
+    res=bat->ir_comp;
+    break;
+    
+  case 26:
+    // pause_saved_ms
+    return sprintf(buf,"%llu\n",bat->pause_saved_ms);
+    
+  case 27:
+    // internal_resistance: текущее значение и оценки по диапазонам, мОм
+    count=sprintf(buf,"%d",bat->ir_mohm);
+    for (i=0;i<BATTERY_IR_BINS;i++) count+=sprintf(buf+count," %d",battery_ir_bin_value(&bat->irest,i));
+    count+=sprintf(buf+count,"\n");
+    return count;
+    
+  case 28:
+    // soc_engine
+    return sprintf(buf,"%s\n",battery_core_soc_engines[bat->soc_engine].name);
+    
+  case 29:
+    // load_model
+    return sprintf(buf,"%d %d\n",bat->load_active_ma,bat->load_sleep_ma);
      
 }     
     
@@ -984,6 +2276,8 @@ return sprintf(buf,"%d\n",res);
 //*****************************************************
 umode_t battery_attr_is_visible(struct kobject *kobj, struct attribute *attr, int attrno) {
   
+// generation, cycle_count, pause_saved_ms и internal_resistance - только чтение  
+if ((attrno == 21) || (attrno == 24) || (attrno == 26) || (attrno == 27)) return 292;
 return 420;
 }
 
@@ -1019,7 +2313,10 @@ return 0;
 int battery_core_register(struct device* dev, struct battery_interface* api) {
   
 struct battery_core_interface* bat;  
-struct workqueue_struct* swq;
+const char* placement;
+u32 cpu;
+u32 val;
+u32 load[2];
 int rc;
 
 if ((dev==0) || (api==0)) return -EINVAL;
@@ -1035,13 +2332,16 @@ if (bat == 0) {
 
 bat->dev=dev;
 mutex_init(&bat->lock);
+mutex_init(&bat->tbl_lock);
 wakeup_source_prepare(&bat->ws, api->bname);
 wakeup_source_add(&bat->ws);
 
 bat->status=POWER_SUPPLY_STATUS_DISCHARGING;
 bat->volt_max=4350000;
 bat->bname=api->bname;
-bat->current_max=1000000;
+// ibat_max по умолчанию совпадает с ограничением ichg_max зарядника (2000 мА):
+// прежде событие 4 получало мкА вместо мА, и действующим ограничением было именно оно
+bat->current_max=2000000;
 bat->current_now=0;
 bat->x444=0;
 bat->volt_now=0;
@@ -1049,18 +2349,17 @@ bat->volt_avg=0;
 bat->capacity=80;
 bat->x448=3;
 bat->temp=25;
+bat->temp_dc=250;
 bat->cap_changed_margin=10;
 bat->present=1;
 bat->health=POWER_SUPPLY_HEALTH_UNKNOWN;
-bat->vref=1800000;
-bat->vref_calib=1800000;
 bat->debug_mode=0;
 bat->test_mode=0;
 
-bat->ntc=ntc_tvm_tables;
-bat->ntcsize=35;
-bat->cap=battery_capacity_table;
-bat->capsize=battery_capacity_table_size;
+RCU_INIT_POINTER(bat->ntc,0);
+battery_core_load_ntc_table(bat,ntc_tvm_tables,ntc_table_size,ntc_table_vref,ntc_table_vref);
+RCU_INIT_POINTER(bat->cap,0);
+battery_core_load_capacity_table(bat,battery_capacity_table,battery_capacity_table_size);
 
 bat->prechare_volt=3000;
 bat->disable_chg=0;
@@ -1088,11 +2387,12 @@ bat->temp_high_poweroff=65;
 bat->api=api;
 api->bat=bat;
 
-bat->charger=charger_core_get_charger_interface_by_name(api->bname);
-api->x_timer_suspend_proc=0;
+bat->charger=0;
+bat->charger_bound=0;
+api->x_timer_suspend_proc=battery_core_x_timer_suspend;
 api->alarm_wakeup_proc=battery_core_wakeup;
-api->timer_resume_proc=0;
-api->timer_suspend_proc=0;
+api->timer_resume_proc=battery_core_timer_resume;
+api->timer_suspend_proc=battery_core_timer_suspend;
 
 bat->chg_mon_period=20000;
 bat->dischg_mon_period=25000;
@@ -1103,6 +2403,25 @@ bat->work.work.entry.prev=&bat->work.work.entry;
 
 bat->new_status=0;
 bat->x408=0;
+bat->mon_state=BATTERY_MON_TEMP;
+bat->mon_chg_suspended=0;
+battery_volt_filter_init(&bat->vfilter);
+battery_ir_init(&bat->irest);
+battery_soc_kalman_init(&bat->kalman);
+bat->mon_slope=0;
+bat->mon_prev_volt=0;
+bat->mon_prev_status=bat->status;
+spin_lock_init(&bat->mon_lock);
+bat->mon_stopped=0;
+// быстрый старт: первый цикл инициализирует интегратор своей выборкой целиком
+bat->mon_fast_start=1;
+bat->mon_burst=1;
+bat->mon_samples=BATTERY_MON_BURST_SAMPLES;
+bat->mon_reseed_weight=1<<BATTERY_FILTER_SHIFT;
+bat->suspend_time=ktime_get_boottime();
+seqlock_init(&bat->snap_lock);
+bat->mon_busy=0;
+bat->mon_events=0;
 bat->work.work.func=battery_core_monitor_work;
 
 init_timer_key(&bat->work.timer,2,0,0);
@@ -1111,13 +2430,91 @@ bat->work.timer.data=(unsigned int)(&bat->work);
 
 
 bat->work.timer.function=delayed_work_timer_fn;
+INIT_DEFERRABLE_WORK(&bat->idle_work,battery_core_monitor_idle_work);
+INIT_DELAYED_WORK(&bat->safety_work,battery_core_monitor_safety_work);
 bat->mon_queue = alloc_workqueue("batt_monitor_wq", WQ_MEM_RECLAIM, 1);
-swq=bat->mon_queue;
-if (bat->mon_queue == 0) {
-  pr_err("failed to create_workqueue batt_monitor_wq!");
-  swq=system_wq;
+if (bat->mon_queue == 0) pr_err("failed to create_workqueue batt_monitor_wq!");
+
+// размещение work монитора: по умолчанию очередь энергосбережения,
+// чтобы простаивающие ядра не будились ради опроса батареи
+bat->mon_placement=BATTERY_MON_PLACE_POWER_EFFICIENT;
+bat->mon_cpu=1;
+bat->mon_irq_cpu=-1;
+if (dev->of_node != 0) {
+  if (of_property_read_string(dev->of_node,"battery-core,monitor-placement",&placement) == 0) {
+    rc=battery_core_parse_placement(placement);
+    if (rc >= 0) bat->mon_placement=rc;
+    else pr_err("unknown monitor placement '%s'\n",placement);
+  }
+  if ((of_property_read_u32(dev->of_node,"battery-core,monitor-cpu",&cpu) == 0) && (cpu < nr_cpu_ids)) bat->mon_cpu=cpu;
+}
+bat->mon_place=bat->mon_placement;
+
+// компенсация внутреннего сопротивления при зарядке: по умолчанию выключена
+bat->ir_comp=0;
+bat->ir_learn_cycles=BATTERY_IR_LEARN_CYCLES;
+if (dev->of_node != 0) {
+  bat->ir_comp=of_property_read_bool(dev->of_node,"battery-core,ir-compensation");
+  if ((of_property_read_u32(dev->of_node,"battery-core,ir-learn-cycles",&val) == 0) && (val > 0)) bat->ir_learn_cycles=val;
 }
-queue_delayed_work_on(1,swq,&bat->work ,msecs_to_jiffies(250));
+
+// оценка уровня заряда: по умолчанию прежний интегратор
+bat->soc_engine=BATTERY_SOC_INTEGRATOR;
+bat->design_mah=0;
+if (dev->of_node != 0) {
+  if (of_property_read_string(dev->of_node,"battery-core,soc-engine",&placement) == 0) {
+    rc=battery_core_parse_soc_engine(placement);
+    if (rc >= 0) bat->soc_engine=rc;
+    else pr_err("unknown soc engine '%s'\n",placement);
+  }
+  if (of_property_read_u32(dev->of_node,"battery-core,design-capacity-mah",&val) == 0) bat->design_mah=val;
+}
+if ((bat->soc_engine == BATTERY_SOC_COUNTER) && (bat->design_mah <= 0)) {
+  pr_err("soc engine 'counter' requires battery-core,design-capacity-mah, using integrator\n");
+  bat->soc_engine=BATTERY_SOC_INTEGRATOR;
+}
+
+// счетчик заряда и модель нагрузки
+bat->load_active_ma=BATTERY_LOAD_ACTIVE_MA;
+bat->load_sleep_ma=BATTERY_LOAD_SLEEP_MA;
+if ((dev->of_node != 0) && (of_property_read_u32_array(dev->of_node,"battery-core,load-model-ma",load,2) == 0)) {
+  bat->load_active_ma=load[0];
+  bat->load_sleep_ma=load[1];
+}
+battery_counter_init(&bat->counter,bat->design_mah,ktime_to_ms(ktime_get_boottime()));
+
+// хранилище состояния: раздел MTD из device tree, для отладки - файл;
+// без них состояние не сохраняется
+mutex_init(&bat->state_lock);
+bat->state=0;
+if (dev->of_node != 0) {
+  if (of_property_read_string(dev->of_node,"battery-core,state-mtd",&placement) == 0)
+    bat->state=battery_state_mtd_backend(placement);
+  else if (of_property_read_string(dev->of_node,"battery-core,state-file",&placement) == 0)
+    bat->state=battery_state_file_backend(placement);
+}
+if (IS_ERR(bat->state)) {
+  pr_err("battery state storage '%s' unavailable, rc=%ld\n",placement,PTR_ERR(bat->state));
+  bat->state=0;
+}
+bat->state_time=ktime_get_boottime();
+if (battery_core_state_restore(bat) != 0) {
+  bat->temp_dc=bat->saved.temp_dc;
+  bat->temp=DIV_ROUND_CLOSEST(bat->temp_dc,10);
+}
+if (bat->state != 0) {
+  bat->state_nb.notifier_call=battery_core_state_reboot;
+  register_reboot_notifier(&bat->state_nb);
+}
+// первый снимок - после настройки счетчика заряда и восстановления состояния
+battery_core_publish(bat);
+
+battery_core_monitor_schedule(bat,BATTERY_MON_TEMP,250);
+// work готов - можно принимать события зарядника. Сначала подписка, затем поиск:
+// зарядник, зарегистрированный между ними, будет привязан только один раз.
+bat->charger_nb.notifier_call=battery_core_charger_notify;
+charger_core_register_notifier(&bat->charger_nb);
+battery_core_attach_charger(bat,charger_core_get_charger_interface_by_name(bat->bname));
 
 bat->psy.name=bat->bname;
 bat->psy.type=1;
@@ -1126,7 +2523,7 @@ bat->psy.num_properties=ARRAY_SIZE(battery_core_power_props);
 bat->psy.get_property=battery_core_get_property;
 bat->psy.set_property=battery_core_set_property;
 bat->psy.property_is_writeable=battery_core_property_is_writeable;
-bat->psy.external_power_changed=battery_core_external_power_changed;
+bat->psy.external_power_changed=battery_core_supply_changed;
 
 rc=power_supply_register(bat->dev,&bat->psy);
 if (rc<0) {
@@ -1148,10 +2545,24 @@ return 0;
 // Обработка ошибок
 err_power_supply_register_bat:
 
+charger_core_unregister_notifier(&bat->charger_nb);
+charger_core_put(battery_core_detach_charger(bat));
+battery_core_monitor_stop(bat);
+cancel_delayed_work_sync(&bat->idle_work);
+cancel_delayed_work_sync(&bat->safety_work);
 cancel_delayed_work_sync(&bat->work);
+if (bat->state != 0) {
+  unregister_reboot_notifier(&bat->state_nb);
+  battery_state_backend_release(bat->state);
+}  
+mutex_destroy(&bat->state_lock);
 if (bat->mon_queue != 0) destroy_workqueue(bat->mon_queue);
 wakeup_source_remove(&bat->ws);
 wakeup_source_drop(&bat->ws);
+// читателей таблицы больше нет: sysfs и монитор уже остановлены
+kfree(rcu_dereference_protected(bat->cap,1));
+kfree(rcu_dereference_protected(bat->ntc,1));
+mutex_destroy(&bat->tbl_lock);
 mutex_destroy(&bat->lock);
 kfree(bat);
 return rc;
@@ -1163,15 +2574,39 @@ return rc;
 void battery_core_unregister(struct device *dev,struct battery_interface *api) {
 
 struct battery_core_interface* bat;  
+struct charger_core_interface* chg;
   
 if ((api== 0) || (api->bat == 0)) return;
 bat=api->bat;
 
 battery_core_remove_sysfs_interface(dev);
 power_supply_unregister(&bat->psy);
+// отключаем события зарядника, затем останавливаем монитор;
+// если он прерван посреди измерения - возвращаем зарядку
+charger_core_unregister_notifier(&bat->charger_nb);
+chg=battery_core_detach_charger(bat);
+battery_core_monitor_stop(bat);
+cancel_delayed_work_sync(&bat->idle_work);
+cancel_delayed_work_sync(&bat->safety_work);
+cancel_delayed_work_sync(&bat->work);
+if ((bat->mon_chg_suspended != 0) && (chg != 0) && (chg->api->resume_charging != 0)) 
+  (*chg->api->resume_charging)(chg->api);
+charger_core_put(chg);
+if (bat->ws.active != 0) __pm_relax(&bat->ws);
+// последнее состояние перед выгрузкой
+if (bat->state != 0) {
+  unregister_reboot_notifier(&bat->state_nb);
+  battery_core_state_store(bat);
+  battery_state_backend_release(bat->state);
+}  
+mutex_destroy(&bat->state_lock);
 if (bat->mon_queue != 0) destroy_workqueue(bat->mon_queue);
 wakeup_source_remove(&bat->ws);
 wakeup_source_drop(&bat->ws);
+// читателей таблицы больше нет: sysfs и монитор уже остановлены
+kfree(rcu_dereference_protected(bat->cap,1));
+kfree(rcu_dereference_protected(bat->ntc,1));
+mutex_destroy(&bat->tbl_lock);
 mutex_destroy(&bat->lock);
 kfree(bat);
 }
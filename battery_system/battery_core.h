@@ -1,3 +1,10 @@
+#include "battery_filter.h"
+#include "battery_tables.h"
+#include "battery_state.h"
+#include "battery_ir.h"
+#include "battery_soc.h"
+#include "battery_counter.h"
+
 int32_t jrd_qpnp_vadc_read(enum qpnp_vadc_channels channel,struct qpnp_vadc_result *result);
 
 //*************************************************
@@ -27,8 +34,104 @@ struct battery_interface {
   struct rtc_timer rtctimer; //72
   struct rtc_device* rtcfd; //120
   struct device* parent; //124
+  // пакетное чтение count выборок канала АЦП за один вызов, результат - усеченное среднее
+  int (*get_adc_batch_proc)(struct battery_interface*, int channel, int count, int* val, int* spread);
+  int hw_avg_vbat;  // число выборок, усредняемых VADC аппаратно за одно преобразование vbat (qcom,fast-avg-setup)
+  int hw_avg_tbat;  // то же для канала tbat
+};
+
+
+//*****************************************************
+//*  Таблица емкостей, публикуемая через RCU
+//*****************************************************
+// Объект неизменяем после публикации: запись в sysfs строит новую таблицу
+// и подменяет указатель, старая освобождается после периода RCU.
+struct battery_capacity_table {
+  struct rcu_head rcu;
+  int size;
+  struct capacity rows[CAPACITY_CURVE_MAX_ROWS];
+  struct capacity_curve curve;
+};
+
+//*****************************************************
+//*  Таблица NTC с калибровкой опорного напряжения
+//*****************************************************
+// Публикуется через RCU целиком вместе с vref/vref_calib, так что монитор
+// всегда видит согласованную пару таблица+калибровка.
+#define BATTERY_NTC_CALIB_SHIFT 24   // дробные биты множителя калибровки
+
+struct battery_ntc_table {
+  struct rcu_head rcu;
+  int vref;             // опорное напряжение АЦП, мкВ
+  int vref_calib;       // измеренное опорное напряжение, мкВ
+  s64 calib_scale;      // vref_calib/vref << BATTERY_NTC_CALIB_SHIFT, 0 - калибровка не нужна
+  int size;
+  struct ntc_tvm rows[NTC_LOOKUP_MAX_ROWS];
+  struct ntc_lookup lookup;
+};
+
+//*****************************************************
+//*  Размещение work монитора по процессорам
+//*****************************************************
+enum battery_core_monitor_placement {
+  BATTERY_MON_PLACE_PINNED=0,         // всегда процессор mon_cpu (исходно - CPU1)
+  BATTERY_MON_PLACE_UNBOUND,          // любой процессор, выбирает планировщик
+  BATTERY_MON_PLACE_POWER_EFFICIENT,  // system_power_efficient_wq
+  BATTERY_MON_PLACE_IRQ_CPU,          // процессор, обработавший последнее событие зарядника
+  BATTERY_MON_PLACE_COUNT
+};
+
+//*****************************************************
+//*  Опубликованное состояние батареи
+//*****************************************************
+// Копия рабочих полей battery_core_interface, которую видят читатели power_supply.
+// Обновляется целиком под seqlock один раз за цикл монитора, читается без блокировок.
+struct battery_core_snapshot {
+  int status;
+  int health;
+  int present;
+  int volt_now;
+  int volt_avg;
+  int volt_max;
+  int current_now;
+  int current_max;
+  int capacity;
+  int temp;
+  int resistance;           // внутреннее сопротивление, мкОм
+  int soc_engine;           // отображаемая оценка уровня заряда
+  struct battery_counter counter; // счетчик заряда на момент публикации
+  unsigned int generation;  // растет с каждой публикацией
+};
+
+//*****************************************************
+//*  Шаги конечного автомата монитора батареи
+//*****************************************************
+enum battery_core_monitor_state {
+  BATTERY_MON_TEMP=0,   // пакет выборок напряжения NTC
+  BATTERY_MON_IR,       // выборка vbat сразу после остановки зарядки - для оценки сопротивления
+  BATTERY_MON_SETTLE    // ожидание стабилизации напряжения после остановки зарядки, затем пакет выборок vbat
+};
+
+//*****************************************************
+//*  Способы оценки уровня заряда
+//*****************************************************
+enum battery_core_soc_engine_id {
+  BATTERY_SOC_INTEGRATOR=0,  // интегратор напряжения и гистерезис таблицы
+  BATTERY_SOC_KALMAN,        // фильтр Калмана по кривой OCV и току зарядки
+  BATTERY_SOC_COUNTER,       // счетчик заряда, привязанный к OCV в покое
+  BATTERY_SOC_COUNT
+};
+
+struct battery_core_interface;
+
+struct battery_soc_engine {
+  const char* name;
+  // оценка уровня заряда, %; capupdate - признак смены отображаемого уровня
+  int (*estimate)(struct battery_core_interface* bat, const struct battery_soc_input* in, int* capupdate);
 };
 
+#define BATTERY_MON_SAMPLES 8   // число выборок АЦП на один канал за цикл монитора
+#define BATTERY_MON_BURST_SAMPLES 32 // число выборок в пакете быстрого старта
 
 //*****************************************************
 //*  Главная интерфейсная структура battery_core
@@ -105,12 +208,8 @@ struct battery_core_interface {
    int temp_high_disable_charge; //524
    int temp_high_poweroff;    //528
    int temp_error_margin;   //532  
-   int vref;              // 536
-   int vref_calib;        // 540
-   struct ntc_tvm* ntc;  // 544
-   int ntcsize;          // 548
-   struct capacity* cap; //552
-   int capsize;  //556	
+   struct battery_ntc_table __rcu* ntc;  // 544
+   struct battery_capacity_table __rcu* cap; //552
    int x560;
    int x564;
    int x568;
@@ -119,10 +218,84 @@ struct battery_core_interface {
    int x580;
    int x584;
    int x588;
+
+   // состояние конечного автомата монитора
+   int mon_state;                      // текущий шаг, enum battery_core_monitor_state
+   int mon_samples;                    // число выборок на канал в текущем цикле
+   int mon_chg_suspended;              // зарядка приостановлена монитором на время измерения
+
+   // адаптивный период монитора
+   int mon_slope;                      // сглаженная скорость изменения volt_avg, мкВ/с
+   int mon_prev_volt;                  // volt_avg предыдущего цикла, мкВ (0 - нет данных)
+   ktime_t mon_prev_time;              // время измерения mon_prev_volt
+   int mon_prev_status;                // статус зарядки при измерении mon_prev_volt
+   int mon_period;                     // период до следующего цикла, мс
+   struct delayed_work idle_work;      // плановый запуск цикла, отложенный таймер
+   struct delayed_work safety_work;    // проверка порогов отключения, жесткий таймер
+   ktime_t suspend_time;               // момент ухода в suspend
+   int mon_reseed_weight;              // вес первой выборки после resume, 0 - обычное интегрирование
+   int mon_fast_start;                 // первый цикл после регистрации: пакет выборок, прямая инициализация интегратора
+   int mon_burst;                      // цикл после регистрации или resume: пакет выборок, короткая стабилизация
+
+   // внеочередной запуск монитора по событиям зарядника
+   spinlock_t mon_lock;                // защита mon_busy/mon_events и постановки work в очередь
+   int mon_busy;                       // цикл измерений выполняется
+   int mon_stopped;                    // монитор остановлен (выгрузка или suspend), новые работы не ставятся
+   unsigned int mon_events;            // накопленные события зарядника, CHARGER_EVENT_*
+   int charger_bound;                  // обработчик событий установлен в charger_core
+   struct notifier_block charger_nb;   // уведомления о регистрации зарядников
+
+   // размещение work монитора
+   int mon_placement;                  // заданная политика, enum battery_core_monitor_placement
+   int mon_place;                      // политика текущего цикла, меняется только между циклами
+   int mon_cpu;                        // процессор для BATTERY_MON_PLACE_PINNED
+   int mon_irq_cpu;                    // процессор последнего события зарядника, -1 - не было
+
+   seqlock_t snap_lock;                // защита snap
+   struct battery_core_snapshot snap;  // состояние, видимое через power_supply
+
+   struct battery_volt_filter vfilter; // интегратор напряжения между циклами монитора
+   struct mutex tbl_lock;              // сериализация замены таблиц через sysfs
+   int temp_dc;                        // температура с точностью 0.1 C
+
+   // состояние, сохраняемое между перезагрузками
+   struct battery_state_backend* state; // хранилище блока состояния, 0 - не сохраняется
+   struct battery_state_blob saved;    // блок, прочитанный при старте
+   int state_loaded;                   // saved прочитан и проверен
+   ktime_t state_time;                 // время последней записи блока
+   struct mutex state_lock;            // сериализация обращений к хранилищу
+   struct notifier_block state_nb;     // запись блока при выключении и перезагрузке
+   int ir_mohm;                        // внутреннее сопротивление при текущей температуре, мОм, 0 - не оценено
+   struct battery_ir_estimator irest;  // оценка сопротивления по температурным диапазонам
+   unsigned int cycle_pct;             // накопленный разряд, % (100 - один цикл)
+
+   // измерение напряжения под нагрузкой с компенсацией внутреннего сопротивления
+   int ir_comp;                        // режим включен
+   int ir_learn_cycles;                // зарядка приостанавливается для обучения раз в столько циклов
+   int mon_ir_count;                   // циклов с компенсацией после последнего обучения
+   int mon_ir_comp;                    // текущий цикл измеряет под нагрузкой
+   int mon_ichg;                       // зарядный ток текущего цикла, мА
+   int mon_vload;                      // напряжение под нагрузкой перед паузой, мкВ, 0 - нет
+   u64 pause_saved_ms;                 // суммарное время пауз зарядки, сэкономленное компенсацией
+
+   // оценка уровня заряда
+   int soc_engine;                     // отображаемая оценка, enum battery_core_soc_engine_id
+   struct battery_soc_kalman kalman;   // состояние фильтра Калмана
+   ktime_t soc_time;                   // время предыдущей оценки
+   int design_mah;                     // емкость аккумулятора, мАч, 0 - неизвестна
+   int mon_spread;                     // разброс выборок напряжения цикла, мкВ, 0 - неизвестен
+
+   // счетчик заряда
+   struct battery_counter counter;     // интеграл тока зарядки и модели нагрузки
+   int load_active_ma;                 // модель нагрузки: ток разряда без зарядки, мА
+   int load_sleep_ma;                  // то же в suspend, мА
+   int counter_sleeping;               // система уходит в suspend - действует load_sleep_ma
 };   
 
 
 // Прототипы внешних подпрограмм
 
 int battery_core_register(struct device* dev, struct battery_interface* api);
+int battery_core_calculate_average_n(int* data, int n);
+int battery_core_calculate_spread(int* data, int n);
 void battery_core_unregister(struct device *dev, struct battery_interface *api);
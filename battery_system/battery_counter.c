@@ -0,0 +1,86 @@
+#include <linux/kernel.h>
+#include <linux/math64.h>
+#include "battery_counter.h"
+
+//*****************************************************
+//*  Инициализация счетчика
+//*****************************************************
+void battery_counter_init(struct battery_counter* c, int design_mah, s64 now) {
+
+c->full=(s64)design_mah*3600000;
+c->charge=0;
+c->total=0;
+c->time=now;
+c->current=0;
+c->valid=0;
+}
+
+//*****************************************************
+//*  Заряд за текущий интервал до момента now, мА*мс
+//*****************************************************
+s64 battery_counter_delta(const struct battery_counter* c, s64 now) {
+
+if (now <= c->time) return 0;
+return (now-c->time)*c->current;
+}
+
+//*****************************************************
+//*  Смена тока
+//*****************************************************
+// Прошедший интервал учитывается со старым током, новый ток действует с now
+void battery_counter_set_current(struct battery_counter* c, int ma, s64 now) {
+
+s64 d;
+
+d=battery_counter_delta(c,now);
+c->total+=d;
+c->charge+=d;
+if (c->charge < 0) c->charge=0;
+if ((c->full > 0) && (c->charge > c->full)) c->charge=c->full;
+if (now > c->time) c->time=now;
+c->current=ma;
+}
+
+//*****************************************************
+//*  Привязка остатка к уровню заряда по OCV
+//*****************************************************
+void battery_counter_rebase(struct battery_counter* c, int percent) {
+
+if (c->full <= 0) return;
+if (percent < 0) percent=0;
+if (percent > 100) percent=100;
+c->charge=div64_s64(c->full*percent,100);
+c->valid=1;
+}
+
+//*****************************************************
+//*  Остаток заряда на момент now, мА*мс
+//*****************************************************
+// Состояние счетчика не меняется - годится для чтения снимка между циклами
+s64 battery_counter_charge_at(const struct battery_counter* c, s64 now) {
+
+s64 q;
+
+q=c->charge+battery_counter_delta(c,now);
+if (q < 0) q=0;
+if ((c->full > 0) && (q > c->full)) q=c->full;
+return q;
+}
+
+//*****************************************************
+//*  Суммарный заряд на момент now, мА*мс
+//*****************************************************
+s64 battery_counter_total_at(const struct battery_counter* c, s64 now) {
+
+return c->total+battery_counter_delta(c,now);
+}
+
+//*****************************************************
+//*  Уровень заряда на момент now, %
+//*****************************************************
+// -1, если емкость неизвестна или остаток еще ни разу не привязан
+int battery_counter_percent_at(const struct battery_counter* c, s64 now) {
+
+if ((c->full <= 0) || (c->valid == 0)) return -1;
+return (int)div64_s64(battery_counter_charge_at(c,now)*100+c->full/2,c->full);
+}
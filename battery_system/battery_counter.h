@@ -0,0 +1,33 @@
+#ifndef _BATTERY_COUNTER_H
+#define _BATTERY_COUNTER_H
+
+#include <linux/types.h>
+
+//*****************************************************
+//*  Счетчик заряда аккумулятора
+//*****************************************************
+// Интегрирует ток по монотонному времени кусочно-постоянно: ток задается на
+// интервал, при смене тока прошедший интервал добавляется к заряду. Заряд
+// хранится в мА*мс, чтобы пересчет в мкАч не накапливал ошибку округления.
+// Время - в мс от любого монотонного начала отсчета.
+
+#define BATTERY_COUNTER_MAMS_PER_UAH 3600   // 1 мкАч = 3600 мА*мс
+
+struct battery_counter {
+  s64 charge;       // остаток заряда, мА*мс, 0..full
+  s64 total;        // суммарный заряд с момента запуска, мА*мс (отрицательный - разряд)
+  s64 full;         // полный заряд, мА*мс, 0 - емкость неизвестна
+  s64 time;         // начало текущего интервала, мс
+  int current;      // ток текущего интервала, мА (+ заряд, - разряд)
+  int valid;        // остаток привязан к уровню заряда хотя бы раз
+};
+
+void battery_counter_init(struct battery_counter* c, int design_mah, s64 now);
+s64 battery_counter_delta(const struct battery_counter* c, s64 now);
+void battery_counter_set_current(struct battery_counter* c, int ma, s64 now);
+void battery_counter_rebase(struct battery_counter* c, int percent);
+s64 battery_counter_charge_at(const struct battery_counter* c, s64 now);
+s64 battery_counter_total_at(const struct battery_counter* c, s64 now);
+int battery_counter_percent_at(const struct battery_counter* c, s64 now);
+
+#endif
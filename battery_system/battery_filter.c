@@ -0,0 +1,91 @@
+#include <linux/kernel.h>
+#include <linux/math64.h>
+#include "battery_filter.h"
+
+//*****************************************************
+//*  Инициализация интегратора
+//*****************************************************
+void battery_volt_filter_init(struct battery_volt_filter* f) {
+
+battery_volt_filter_reset(f);
+}
+
+//*****************************************************
+//*  Сброс интегратора
+//*****************************************************
+void battery_volt_filter_reset(struct battery_volt_filter* f) {
+
+f->sum=0;
+f->average=0;
+f->count=0;
+f->initialized=0;
+}
+
+//*****************************************************
+//*  Текущее значение интегратора, мкВ
+//*****************************************************
+int battery_volt_filter_value(const struct battery_volt_filter* f) {
+
+return (int)((f->average+(1<<(BATTERY_FILTER_SHIFT-1)))>>BATTERY_FILTER_SHIFT);
+}
+
+//*****************************************************
+//*  Добавление новой выборки в интегратор
+//*****************************************************
+// volt - усредненное за цикл монитора напряжение, мкВ
+// charging - идет зарядка: новая выборка берется с полным весом
+// Возвращает новое интегральное значение напряжения, мкВ
+int battery_volt_filter_update(struct battery_volt_filter* f, int volt, int charging) {
+
+s64 v,cm;
+int dv;
+
+v=(s64)volt<<BATTERY_FILTER_SHIFT;
+
+if (f->initialized == 0) {
+  // начальный этап накопления данных интегратора - первые 8 выборок считаем просто среднее
+  f->count++;
+  f->sum+=v;
+  f->average=div_s64(f->sum,f->count);
+  if (f->count>7) f->initialized=1;
+}
+else {
+  // Все последующие выборки, начиная от 9 - учитываем предыдущий хвост
+  if (charging) dv=32;
+  else  dv=((f->count<32) ? 32 : f->count);
+  f->count++;
+  cm=dv*v+f->average*(32-dv);
+  f->sum+=div_s64(cm,32);
+  f->average=div_s64(f->sum,f->count);
+  if (f->count > 63) {
+    // сделаны 64 выборки - результат представляем как первые 8 выборок нового цикла
+    f->sum=f->average*8;
+    f->count=8;
+  }
+}
+return battery_volt_filter_value(f);
+}
+
+//*****************************************************
+//*  Повторная инициализация интегратора новой выборкой
+//*****************************************************
+// volt - новая выборка, мкВ
+// weight - вес новой выборки относительно накопленного среднего, 0..(1<<BATTERY_FILTER_SHIFT)
+// Интегратор переводится в состояние "8 выборок с новым средним", так что последующие
+// выборки учитываются как после начального накопления.
+// Возвращает новое интегральное значение напряжения, мкВ
+int battery_volt_filter_reseed(struct battery_volt_filter* f, int volt, int weight) {
+
+s64 v;
+
+v=(s64)volt<<BATTERY_FILTER_SHIFT;
+if (weight > (1<<BATTERY_FILTER_SHIFT)) weight=1<<BATTERY_FILTER_SHIFT;
+if (weight < 0) weight=0;
+// истории нет - берем выборку целиком
+if (f->count == 0) weight=1<<BATTERY_FILTER_SHIFT;
+f->average+=((v-f->average)*weight)>>BATTERY_FILTER_SHIFT;
+f->count=8;
+f->sum=f->average*8;
+f->initialized=1;
+return battery_volt_filter_value(f);
+}
@@ -0,0 +1,27 @@
+#ifndef _BATTERY_FILTER_H
+#define _BATTERY_FILTER_H
+
+#include <linux/types.h>
+
+//*****************************************************
+//*  Интегратор напряжения аккумулятора
+//*****************************************************
+// Состояние хранится в формате с фиксированной точкой: значение в мкВ, сдвинутое
+// на BATTERY_FILTER_SHIFT бит влево, чтобы деление на 32 и на count не теряло дробную часть.
+
+#define BATTERY_FILTER_SHIFT 8
+
+struct battery_volt_filter {
+  s64 sum;          // накопленная сумма выборок
+  s64 average;      // текущее среднее
+  int count;        // число учтенных выборок
+  int initialized;  // начальное накопление (первые 8 выборок) завершено
+};
+
+void battery_volt_filter_init(struct battery_volt_filter* f);
+void battery_volt_filter_reset(struct battery_volt_filter* f);
+int battery_volt_filter_update(struct battery_volt_filter* f, int volt, int charging);
+int battery_volt_filter_value(const struct battery_volt_filter* f);
+int battery_volt_filter_reseed(struct battery_volt_filter* f, int volt, int weight);
+
+#endif
@@ -0,0 +1,87 @@
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include "battery_ir.h"
+
+//*****************************************************
+//*  Сброс оценки
+//*****************************************************
+void battery_ir_init(struct battery_ir_estimator* e) {
+
+int i;
+
+for (i=0;i<BATTERY_IR_BINS;i++) {
+  e->value[i]=0;
+  e->count[i]=0;
+}
+}
+
+//*****************************************************
+//*  Номер температурного диапазона
+//*****************************************************
+int battery_ir_bin(int temp_dc) {
+
+int bin;
+
+if (temp_dc < 0) return 0;
+bin=1+temp_dc/BATTERY_IR_BIN_WIDTH;
+if (bin >= BATTERY_IR_BINS) bin=BATTERY_IR_BINS-1;
+return bin;
+}
+
+//*****************************************************
+//*  Учет нового скачка тока
+//*****************************************************
+// dv - изменение напряжения, мкВ; di - изменение тока того же знака, мА
+// Возвращает выборку сопротивления в мОм или -EINVAL, если она неправдоподобна
+int battery_ir_update(struct battery_ir_estimator* e, int temp_dc, int dv, int di) {
+
+int r,bin,n;
+
+if (di == 0) return -EINVAL;
+r=dv/di;
+if ((r < BATTERY_IR_MIN) || (r > BATTERY_IR_MAX)) return -EINVAL;
+
+bin=battery_ir_bin(temp_dc);
+n=e->count[bin];
+if (n < BATTERY_IR_WEIGHT) e->count[bin]=++n;
+e->value[bin]+=((r<<BATTERY_IR_SHIFT)-e->value[bin])/n;
+return r;
+}
+
+//*****************************************************
+//*  Оценка одного диапазона, мОм (0 - нет данных)
+//*****************************************************
+int battery_ir_bin_value(const struct battery_ir_estimator* e, int bin) {
+
+if ((bin < 0) || (bin >= BATTERY_IR_BINS) || (e->count[bin] == 0)) return 0;
+return (e->value[bin]+(1<<(BATTERY_IR_SHIFT-1)))>>BATTERY_IR_SHIFT;
+}
+
+//*****************************************************
+//*  Начальное значение диапазона
+//*****************************************************
+// Используется при восстановлении сохраненного состояния: значение учитывается
+// как половина полного веса, чтобы новые измерения быстро его уточняли.
+void battery_ir_set_bin(struct battery_ir_estimator* e, int bin, int mohm) {
+
+if ((bin < 0) || (bin >= BATTERY_IR_BINS)) return;
+if ((mohm < BATTERY_IR_MIN) || (mohm > BATTERY_IR_MAX)) return;
+e->value[bin]=mohm<<BATTERY_IR_SHIFT;
+e->count[bin]=BATTERY_IR_WEIGHT/2;
+}
+
+//*****************************************************
+//*  Оценка для заданной температуры, мОм (0 - нет данных)
+//*****************************************************
+// Если в диапазоне температуры выборок нет - берется ближайший диапазон с данными
+int battery_ir_value(const struct battery_ir_estimator* e, int temp_dc) {
+
+int bin,d;
+
+bin=battery_ir_bin(temp_dc);
+for (d=0;d<BATTERY_IR_BINS;d++) {
+  if ((bin-d >= 0) && (e->count[bin-d] != 0)) return battery_ir_bin_value(e,bin-d);
+  if ((bin+d < BATTERY_IR_BINS) && (e->count[bin+d] != 0)) return battery_ir_bin_value(e,bin+d);
+}
+return 0;
+}
@@ -0,0 +1,34 @@
+#ifndef _BATTERY_IR_H
+#define _BATTERY_IR_H
+
+#include <linux/types.h>
+
+//*****************************************************
+//*  Оценка внутреннего сопротивления аккумулятора
+//*****************************************************
+// Сопротивление заметно зависит от температуры, поэтому оценка ведется
+// отдельно по температурным диапазонам: ниже 0 C, затем через каждые
+// BATTERY_IR_BIN_WIDTH, последний диапазон открыт сверху. Внутри диапазона
+// выборки сглаживаются: первые BATTERY_IR_WEIGHT усредняются, дальше -
+// экспоненциальное сглаживание с тем же весом.
+
+#define BATTERY_IR_BINS       6
+#define BATTERY_IR_BIN_WIDTH  100   // ширина диапазона, 0.1 C
+#define BATTERY_IR_WEIGHT     8     // вес сглаживания
+#define BATTERY_IR_SHIFT      4     // дробные биты накопленного значения
+#define BATTERY_IR_MIN        10    // правдоподобные пределы сопротивления, мОм
+#define BATTERY_IR_MAX        1000
+
+struct battery_ir_estimator {
+  int value[BATTERY_IR_BINS];   // оценка, мОм << BATTERY_IR_SHIFT
+  int count[BATTERY_IR_BINS];   // число учтенных выборок, не больше BATTERY_IR_WEIGHT
+};
+
+void battery_ir_init(struct battery_ir_estimator* e);
+int battery_ir_bin(int temp_dc);
+int battery_ir_update(struct battery_ir_estimator* e, int temp_dc, int dv, int di);
+int battery_ir_value(const struct battery_ir_estimator* e, int temp_dc);
+int battery_ir_bin_value(const struct battery_ir_estimator* e, int bin);
+void battery_ir_set_bin(struct battery_ir_estimator* e, int bin, int mohm);
+
+#endif
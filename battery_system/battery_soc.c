@@ -0,0 +1,63 @@
+#include <linux/kernel.h>
+#include <linux/math64.h>
+#include "battery_soc.h"
+
+//*****************************************************
+//*  Сброс фильтра
+//*****************************************************
+void battery_soc_kalman_init(struct battery_soc_kalman* k) {
+
+k->x=0;
+k->p=0;
+k->initialized=0;
+}
+
+//*****************************************************
+//*  Установка начального уровня заряда
+//*****************************************************
+// Дисперсия начальной оценки - погрешность кривой OCV
+void battery_soc_kalman_seed(struct battery_soc_kalman* k, int percent) {
+
+k->x=(s64)percent*BATTERY_SOC_SCALE;
+k->p=(s64)BATTERY_SOC_MODEL_SIGMA*BATTERY_SOC_MODEL_SIGMA;
+k->initialized=1;
+}
+
+//*****************************************************
+//*  Шаг фильтра: прогноз и коррекция по измерению
+//*****************************************************
+// Возвращает уровень заряда, %
+int battery_soc_kalman_update(struct battery_soc_kalman* k, const struct battery_soc_input* in) {
+
+s64 z,r,sigma,gain;
+int spread;
+
+// измерение: уровень по кривой и его дисперсия
+z=capacity_curve_mpercent(in->curve,in->mv,in->charging);
+spread=(in->spread > 0) ? in->spread : BATTERY_SOC_SPREAD;
+// разброс max-min восьми выборок - около трех сигм, берем половину
+sigma=((s64)spread*capacity_curve_slope(in->curve,in->mv,in->charging)*BATTERY_SOC_SCALE/2)>>CAPACITY_CURVE_SHIFT;
+r=sigma*sigma+(s64)BATTERY_SOC_MODEL_SIGMA*BATTERY_SOC_MODEL_SIGMA;
+
+if (k->initialized == 0) {
+  k->x=z;
+  k->p=r;
+  k->initialized=1;
+  goto out;
+}
+
+// прогноз: заряд током ichg за dt (мА*мс -> 0.001% при емкости в мАч)
+if ((in->ichg > 0) && (in->design_mah > 0) && (in->dt > 0)) 
+  k->x+=div64_s64((s64)in->ichg*in->dt,(s64)in->design_mah*36);
+if (in->dt > 0) k->p+=(s64)in->dt*BATTERY_SOC_Q_PER_MS;
+
+// коррекция: K=P/(P+R), коэффициент в единицах 1<<16
+gain=div64_s64(k->p<<16,k->p+r);
+k->x+=((z-k->x)*gain)>>16;
+k->p=((k->p*((1<<16)-gain))>>16)+1;
+
+out:
+if (k->x < 0) k->x=0;
+if (k->x > 100*BATTERY_SOC_SCALE) k->x=100*BATTERY_SOC_SCALE;
+return (int)div64_s64(k->x+BATTERY_SOC_SCALE/2,BATTERY_SOC_SCALE);
+}
@@ -0,0 +1,46 @@
+#ifndef _BATTERY_SOC_H
+#define _BATTERY_SOC_H
+
+#include <linux/types.h>
+#include "battery_tables.h"
+
+//*****************************************************
+//*  Входные данные оценки уровня заряда за цикл
+//*****************************************************
+struct battery_soc_input {
+  int mv;          // напряжение цикла без интегратора, мВ
+  int mv_avg;      // выход интегратора напряжения, мВ
+  int spread;      // разброс выборок цикла (max-min), мВ, 0 - неизвестен
+  int ichg;        // ток зарядки, мА, 0 - не заряжается
+  int charging;    // ветка кривой: зарядка
+  int dt;          // время с предыдущего цикла, мс
+  int design_mah;  // емкость аккумулятора, мАч, 0 - неизвестна
+  int capacity;    // отображаемый сейчас уровень заряда, %
+  const struct capacity_curve* curve;
+};
+
+//*****************************************************
+//*  Фильтр Калмана уровня заряда
+//*****************************************************
+// Одномерный фильтр в фиксированной точке. Состояние - уровень заряда в 0.001%.
+// Прогноз: ток зарядки, отнесенный к емкости аккумулятора, плюс шум процесса,
+// растущий со временем. Измерение: уровень по кривой OCV из напряжения цикла,
+// его дисперсия - разброс выборок, пересчитанный через наклон кривой, плюс
+// погрешность самой кривой (напряжение под нагрузкой - не OCV).
+
+#define BATTERY_SOC_SCALE         1000     // единиц состояния на процент
+#define BATTERY_SOC_MODEL_SIGMA   2000     // погрешность кривой OCV, 0.001%
+#define BATTERY_SOC_SPREAD        10       // разброс выборок, если он неизвестен, мВ
+#define BATTERY_SOC_Q_PER_MS      2        // рост дисперсии прогноза, (0.001%)^2/мс
+
+struct battery_soc_kalman {
+  s64 x;            // оценка уровня заряда, 0.001%
+  s64 p;            // дисперсия оценки, (0.001%)^2
+  int initialized;
+};
+
+void battery_soc_kalman_init(struct battery_soc_kalman* k);
+void battery_soc_kalman_seed(struct battery_soc_kalman* k, int percent);
+int battery_soc_kalman_update(struct battery_soc_kalman* k, const struct battery_soc_input* in);
+
+#endif
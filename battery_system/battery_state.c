@@ -0,0 +1,299 @@
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/err.h>
+#include <linux/fs.h>
+#include <linux/crc32.h>
+#include <linux/completion.h>
+#ifdef CONFIG_MTD
+#include <linux/mtd/mtd.h>
+#endif
+#include "battery_state.h"
+
+//*****************************************************
+//*  Контрольная сумма блока без поля crc
+//*****************************************************
+u32 battery_state_crc(const struct battery_state_blob* blob) {
+
+return crc32_le(~0,(const unsigned char*)blob,offsetof(struct battery_state_blob,crc));
+}
+
+//*****************************************************
+//*  Чтение и проверка блока состояния
+//*****************************************************
+// Возвращает 0, -ENODATA если хранилище пусто, -EBADMSG если блок поврежден
+// или записан другой версией драйвера.
+int battery_state_load(struct battery_state_backend* b, struct battery_state_blob* blob) {
+
+int rc;
+
+if ((b == 0) || (blob == 0)) return -EINVAL;
+rc=(*b->read)(b,blob,sizeof(*blob));
+if (rc < 0) return rc;
+if (rc == 0) return -ENODATA;
+if (rc != sizeof(*blob)) return -EBADMSG;
+if ((blob->magic != BATTERY_STATE_MAGIC) || (blob->version != BATTERY_STATE_VERSION) ||
+    (blob->size != sizeof(*blob))) return -EBADMSG;
+if (blob->crc != battery_state_crc(blob)) return -EBADMSG;
+return 0;
+}
+
+//*****************************************************
+//*  Запись блока состояния
+//*****************************************************
+// Заголовок и контрольная сумма заполняются здесь, вызывающий задает только данные
+int battery_state_save(struct battery_state_backend* b, struct battery_state_blob* blob) {
+
+int rc;
+
+if ((b == 0) || (blob == 0)) return -EINVAL;
+blob->magic=BATTERY_STATE_MAGIC;
+blob->version=BATTERY_STATE_VERSION;
+blob->size=sizeof(*blob);
+blob->crc=battery_state_crc(blob);
+rc=(*b->write)(b,blob,sizeof(*blob));
+if (rc < 0) return rc;
+if (rc != sizeof(*blob)) return -EIO;
+return 0;
+}
+
+//*****************************************************
+//*  Освобождение хранилища
+//*****************************************************
+void battery_state_backend_release(struct battery_state_backend* b) {
+
+if (b == 0) return;
+if (b->release != 0) (*b->release)(b);
+kfree(b);
+}
+
+//*****************************************************
+//*  Хранилище в файле (только для отладки)
+//*****************************************************
+// Файл открывается при каждом обращении: при регистрации драйвера файловая
+// система может быть еще не смонтирована, тогда чтение повторяется позже.
+#ifdef CONFIG_BATTERY_PMD9635_STATE_FILE
+int battery_state_file_read(struct battery_state_backend* b, void* buf, size_t len) {
+
+struct file* f;
+int rc;
+
+f=filp_open((const char*)b->priv,O_RDONLY,0);
+if (IS_ERR(f)) return PTR_ERR(f);
+rc=kernel_read(f,0,(char*)buf,len);
+filp_close(f,0);
+return rc;
+}
+
+int battery_state_file_write(struct battery_state_backend* b, const void* buf, size_t len) {
+
+struct file* f;
+int rc;
+
+f=filp_open((const char*)b->priv,O_WRONLY|O_CREAT|O_TRUNC,0600);
+if (IS_ERR(f)) return PTR_ERR(f);
+rc=kernel_write(f,(const char*)buf,len,0);
+filp_close(f,0);
+return rc;
+}
+
+struct battery_state_backend* battery_state_file_backend(const char* path) {
+
+struct battery_state_backend* b;
+
+if (path == 0) return ERR_PTR(-EINVAL);
+b=kzalloc(sizeof(*b),GFP_KERNEL);
+if (b == 0) return ERR_PTR(-ENOMEM);
+b->name="file";
+b->read=battery_state_file_read;
+b->write=battery_state_file_write;
+b->priv=(void*)path;
+return b;
+}
+#else
+struct battery_state_backend* battery_state_file_backend(const char* path) {
+
+return ERR_PTR(-ENODEV);
+}
+#endif
+
+//*****************************************************
+//*  Хранилище в разделе MTD
+//*****************************************************
+// Под состояние отводится первый исправный стираемый блок раздела. Блок
+// заполняется записями по одной странице подряд и стирается, только когда
+// все страницы заняты: при записи раз в 10 минут блок 128К с 2К страницами
+// стирается примерно раз в 10 часов. Действующая запись - последняя
+// нестертая страница блока.
+#ifdef CONFIG_MTD
+struct battery_state_mtd {
+  struct mtd_info* mtd;
+  loff_t block;      // начало блока состояния в разделе
+  int slots;         // страниц в блоке
+  int next;          // следующая свободная страница, -1 - блок еще не просмотрен
+  u8* page;          // буфер одной страницы
+};
+
+// Страница стерта, если все ее байты 0xff
+int battery_state_mtd_erased(const u8* page, int len) {
+
+int i;
+
+for (i=0;i<len;i++) {
+  if (page[i] != 0xff) return 0;
+}
+return 1;
+}
+
+int battery_state_mtd_read_slot(struct battery_state_mtd* m, int slot) {
+
+size_t n;
+int rc;
+
+rc=mtd_read(m->mtd,m->block+(loff_t)slot*m->mtd->writesize,m->mtd->writesize,&n,m->page);
+// исправленные ECC ошибки не мешают чтению
+if ((rc != 0) && !mtd_is_bitflip(rc)) return rc;
+if (n != m->mtd->writesize) return -EIO;
+return 0;
+}
+
+void battery_state_mtd_erase_done(struct erase_info* ei) {
+
+complete((struct completion*)ei->priv);
+}
+
+int battery_state_mtd_erase(struct battery_state_mtd* m) {
+
+struct erase_info ei;
+struct completion done;
+int rc;
+
+init_completion(&done);
+memset(&ei,0,sizeof(ei));
+ei.mtd=m->mtd;
+ei.addr=m->block;
+ei.len=m->mtd->erasesize;
+ei.callback=battery_state_mtd_erase_done;
+ei.priv=(u_long)&done;
+rc=mtd_erase(m->mtd,&ei);
+if (rc != 0) return rc;
+wait_for_completion(&done);
+if (ei.state != MTD_ERASE_DONE) return -EIO;
+return 0;
+}
+
+int battery_state_mtd_read(struct battery_state_backend* b, void* buf, size_t len) {
+
+struct battery_state_mtd* m=b->priv;
+int slot,last;
+int rc;
+
+// ищем первую стертую страницу, запись перед ней - действующая
+last=-1;
+for (slot=0;slot<m->slots;slot++) {
+  rc=battery_state_mtd_read_slot(m,slot);
+  if (rc != 0) return rc;
+  if (battery_state_mtd_erased(m->page,m->mtd->writesize)) break;
+  last=slot;
+}
+m->next=slot;
+if (last < 0) return 0;
+rc=battery_state_mtd_read_slot(m,last);
+if (rc != 0) return rc;
+if (len > m->mtd->writesize) len=m->mtd->writesize;
+memcpy(buf,m->page,len);
+return len;
+}
+
+int battery_state_mtd_write(struct battery_state_backend* b, const void* buf, size_t len) {
+
+struct battery_state_mtd* m=b->priv;
+size_t n;
+int rc;
+
+if (len > m->mtd->writesize) return -EINVAL;
+// позиция записи неизвестна, пока блок не просмотрен
+if (m->next < 0) {
+  rc=battery_state_mtd_read(b,m->page,0);
+  if (rc < 0) return rc;
+}
+if (m->next >= m->slots) {
+  rc=battery_state_mtd_erase(m);
+  if (rc != 0) {
+    m->next=-1;
+    return rc;
+  }
+  m->next=0;
+}
+memset(m->page,0xff,m->mtd->writesize);
+memcpy(m->page,buf,len);
+rc=mtd_write(m->mtd,m->block+(loff_t)m->next*m->mtd->writesize,m->mtd->writesize,&n,m->page);
+// страница могла записаться частично - следующая запись идет в новую
+m->next++;
+if (rc != 0) return rc;
+if (n != m->mtd->writesize) return -EIO;
+return len;
+}
+
+void battery_state_mtd_release(struct battery_state_backend* b) {
+
+struct battery_state_mtd* m=b->priv;
+
+put_mtd_device(m->mtd);
+kfree(m->page);
+kfree(m);
+}
+
+struct battery_state_backend* battery_state_mtd_backend(const char* partition) {
+
+struct battery_state_backend* b;
+struct battery_state_mtd* m;
+struct mtd_info* mtd;
+loff_t block;
+int rc;
+
+if (partition == 0) return ERR_PTR(-EINVAL);
+mtd=get_mtd_device_nm(partition);
+if (IS_ERR(mtd)) return (void*)mtd;
+rc=-EINVAL;
+if ((mtd->writesize < sizeof(struct battery_state_blob)) || (mtd->erasesize < mtd->writesize)) goto err_put;
+// первый исправный блок раздела
+rc=-ENOSPC;
+for (block=0;block < mtd->size;block+=mtd->erasesize) {
+  if (mtd_block_isbad(mtd,block) == 0) break;
+}
+if (block >= mtd->size) goto err_put;
+
+rc=-ENOMEM;
+b=kzalloc(sizeof(*b),GFP_KERNEL);
+if (b == 0) goto err_put;
+m=kzalloc(sizeof(*m),GFP_KERNEL);
+if (m == 0) goto err_free_b;
+m->page=kmalloc(mtd->writesize,GFP_KERNEL);
+if (m->page == 0) goto err_free_m;
+m->mtd=mtd;
+m->block=block;
+m->slots=mtd->erasesize/mtd->writesize;
+m->next=-1;
+b->name="mtd";
+b->read=battery_state_mtd_read;
+b->write=battery_state_mtd_write;
+b->release=battery_state_mtd_release;
+b->priv=m;
+return b;
+
+err_free_m:
+kfree(m);
+err_free_b:
+kfree(b);
+err_put:
+put_mtd_device(mtd);
+return ERR_PTR(rc);
+}
+#else
+struct battery_state_backend* battery_state_mtd_backend(const char* partition) {
+
+return ERR_PTR(-ENODEV);
+}
+#endif
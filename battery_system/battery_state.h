@@ -0,0 +1,50 @@
+#ifndef _BATTERY_STATE_H
+#define _BATTERY_STATE_H
+
+#include <linux/types.h>
+#include "battery_ir.h"
+
+struct device;
+
+//*****************************************************
+//*  Сохраняемое между перезагрузками состояние батареи
+//*****************************************************
+// Двоичный блок фиксированного формата в порядке байт процессора. Новые поля
+// добавляются только в конец с увеличением версии; блок чужой версии,
+// размера или с неверной контрольной суммой отвергается целиком.
+
+#define BATTERY_STATE_MAGIC   0x31545342   // "BST1"
+#define BATTERY_STATE_VERSION 2
+
+struct battery_state_blob {
+  u32 magic;
+  u16 version;
+  u16 size;          // размер блока вместе с crc
+  s32 capacity;      // последняя емкость, %
+  s32 volt_avg;      // значение интегратора напряжения, мкВ
+  s32 ir_mohm;       // внутреннее сопротивление, мОм, 0 - не оценено
+  u32 cycle_pct;     // накопленный разряд, % (100 - один полный цикл)
+  s32 temp_dc;       // последняя температура, 0.1 C
+  s32 ir_bins[BATTERY_IR_BINS]; // сопротивление по температурным диапазонам, мОм, 0 - нет данных (версия 2)
+  u32 crc;           // crc32 всех предыдущих байт
+} __packed;
+
+//*****************************************************
+//*  Хранилище блока состояния
+//*****************************************************
+struct battery_state_backend {
+  const char* name;
+  int (*read)(struct battery_state_backend* b, void* buf, size_t len);
+  int (*write)(struct battery_state_backend* b, const void* buf, size_t len);
+  void (*release)(struct battery_state_backend* b);
+  void* priv;
+};
+
+struct battery_state_backend* battery_state_mtd_backend(const char* partition);
+struct battery_state_backend* battery_state_file_backend(const char* path);
+void battery_state_backend_release(struct battery_state_backend* b);
+
+int battery_state_load(struct battery_state_backend* b, struct battery_state_blob* blob);
+int battery_state_save(struct battery_state_backend* b, struct battery_state_blob* blob);
+
+#endif
@@ -0,0 +1,207 @@
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/math64.h>
+#include "battery_tables.h"
+
+//*****************************************************
+//*  Построение таблицы поиска температуры NTC
+//*****************************************************
+// Возвращает -EINVAL, если таблица пуста, слишком велика или напряжения
+// в ней не убывают строго монотонно.
+int ntc_lookup_build(struct ntc_lookup* l, const struct ntc_tvm* tbl, int size) {
+
+int i;
+int dv;
+
+if ((l == 0) || (tbl == 0) || (size < 2) || (size > NTC_LOOKUP_MAX_ROWS)) return -EINVAL;
+
+for (i=0;i<size-1;i++) {
+  if (tbl[i].tnvc <= tbl[i+1].tnvc) return -EINVAL;
+}
+
+for (i=0;i<size;i++) {
+  l->tnvc[i]=tbl[i].tnvc;
+  l->temp[i]=tbl[i].tntc*10;
+}
+for (i=0;i<size-1;i++) {
+  dv=l->tnvc[i]-l->tnvc[i+1];
+  l->slope[i]=(int)div_s64((s64)(l->temp[i+1]-l->temp[i])<<NTC_LOOKUP_SHIFT,dv);
+}
+l->slope[size-1]=0;
+l->size=size;
+return 0;
+}
+
+//*****************************************************
+//*  Перевод напряжения NTC в температуру, 0.1 C
+//*****************************************************
+// uv - напряжение на NTC, мкВ
+// clamped - (может быть 0) признак выхода напряжения за пределы таблицы
+int ntc_lookup_temp(const struct ntc_lookup* l, int uv, int* clamped) {
+
+int lo,hi,mid;
+
+if (clamped != 0) *clamped=0;
+
+// выход за границы таблицы - берем крайний узел
+if (uv >= l->tnvc[0]) {
+  if ((clamped != 0) && (uv > l->tnvc[0])) *clamped=1;
+  return l->temp[0];
+}
+if (uv <= l->tnvc[l->size-1]) {
+  if ((clamped != 0) && (uv < l->tnvc[l->size-1])) *clamped=1;
+  return l->temp[l->size-1];
+}
+
+// ищем сегмент tnvc[lo] > uv >= tnvc[lo+1]
+lo=0;
+hi=l->size-1;
+while (hi-lo > 1) {
+  mid=(lo+hi)/2;
+  if (uv < l->tnvc[mid]) lo=mid;
+  else hi=mid;
+}
+return l->temp[lo]+(int)(((s64)(l->tnvc[lo]-uv)*l->slope[lo]+(1<<(NTC_LOOKUP_SHIFT-1)))>>NTC_LOOKUP_SHIFT);
+}
+
+//*****************************************************
+//*  Построение кривой емкости
+//*****************************************************
+// Возвращает -EINVAL, если таблица пуста или слишком велика, проценты убывают
+// или выходят за пределы 0..100, vmin>vmax в какой-либо строке, или начала сегментов хотя бы одной из веток
+// (vmin и vmin-offset) не возрастают строго монотонно.
+int capacity_curve_build(struct capacity_curve* c, const struct capacity* rows, int size) {
+
+int i,b;
+int dv;
+struct capacity_curve_branch* br;
+
+if ((c == 0) || (rows == 0) || (size < 2) || (size > CAPACITY_CURVE_MAX_ROWS)) return -EINVAL;
+
+for (i=0;i<size;i++) {
+  if (rows[i].vmin > rows[i].vmax) return -EINVAL;
+  if (rows[i].hysteresis < 0) return -EINVAL;
+  if ((rows[i].percent < 0) || (rows[i].percent > 100)) return -EINVAL;
+  if (i == 0) continue;
+  if (rows[i].percent < rows[i-1].percent) return -EINVAL;
+  if (rows[i].vmin <= rows[i-1].vmin) return -EINVAL;
+  if ((rows[i].vmin-rows[i].offset) <= (rows[i-1].vmin-rows[i-1].offset)) return -EINVAL;
+}
+
+for (i=0;i<size;i++) {
+  c->percent[i]=rows[i].percent;
+  c->band_lo[i]=rows[i].vmin-rows[i].hysteresis;
+  c->band_hi[i]=rows[i].vmax+rows[i].hysteresis;
+}
+
+for (b=CAPACITY_CURVE_DISCHARGE;b<=CAPACITY_CURVE_CHARGE;b++) {
+  br=&c->branch[b];
+  for (i=0;i<size;i++) {
+    // при зарядке строка i начинается раньше на свой offset
+    br->vstart[i]=rows[i].vmin-((b == CAPACITY_CURVE_CHARGE) ? rows[i].offset : 0);
+  }
+  for (i=0;i<size-1;i++) {
+    // сегмент ветки идет от vstart[i] до vstart[i+1], offset строк может различаться
+    dv=br->vstart[i+1]-br->vstart[i];
+    br->slope[i]=(int)div_s64((s64)(rows[i+1].percent-rows[i].percent)<<CAPACITY_CURVE_SHIFT,dv);
+  }
+  br->slope[size-1]=0;
+}
+c->size=size;
+return 0;
+}
+
+//*****************************************************
+//*  Перевод напряжения в уровень заряда
+//*****************************************************
+// mv - напряжение аккумулятора, мВ
+// charging - выбор ветки: при зарядке учитывается offset строк таблицы
+int capacity_curve_percent(const struct capacity_curve* c, int mv, int charging) {
+
+const struct capacity_curve_branch* br;
+int lo;
+int pct;
+
+br=&c->branch[charging ? CAPACITY_CURVE_CHARGE : CAPACITY_CURVE_DISCHARGE];
+lo=capacity_curve_segment(br,c->size,mv);
+// выход за границы таблицы
+if (lo < 0) return c->percent[0];
+if (lo >= c->size-1) return c->percent[c->size-1];
+pct=c->percent[lo]+(int)(((s64)(mv-br->vstart[lo])*br->slope[lo]+(1<<(CAPACITY_CURVE_SHIFT-1)))>>CAPACITY_CURVE_SHIFT);
+if (pct > c->percent[lo+1]) pct=c->percent[lo+1];
+return pct;
+}
+
+//*****************************************************
+//*  Проверка выхода напряжения из полосы гистерезиса
+//*****************************************************
+// percent - текущий отображаемый уровень заряда, mv - новое напряжение, мВ.
+// Текущему уровню соответствует первая строка, чей процент не меньше его.
+// Возвращает 1, если напряжение вышло за vmin-hysteresis..vmax+hysteresis этой строки.
+int capacity_curve_changed(const struct capacity_curve* c, int percent, int mv) {
+
+int lo,hi,mid;
+
+lo=0;
+hi=c->size-1;
+while (lo < hi) {
+  mid=(lo+hi)/2;
+  if (c->percent[mid] >= percent) hi=mid;
+  else lo=mid+1;
+}
+return ((mv < c->band_lo[lo]) || (mv > c->band_hi[lo]));
+}
+
+//*****************************************************
+//*  Поиск сегмента ветки по напряжению
+//*****************************************************
+// Возвращает lo: vstart[lo] <= mv < vstart[lo+1], -1 ниже таблицы, size-1 выше
+int capacity_curve_segment(const struct capacity_curve_branch* br, int size, int mv) {
+
+int lo,hi,mid;
+
+if (mv < br->vstart[0]) return -1;
+if (mv > br->vstart[size-1]) return size-1;
+lo=0;
+hi=size-1;
+while (hi-lo > 1) {
+  mid=(lo+hi)/2;
+  if (mv < br->vstart[mid]) hi=mid;
+  else lo=mid;
+}
+return lo;
+}
+
+//*****************************************************
+//*  Перевод напряжения в уровень заряда, 0.001%
+//*****************************************************
+// То же, что capacity_curve_percent, но без округления до процента
+int capacity_curve_mpercent(const struct capacity_curve* c, int mv, int charging) {
+
+const struct capacity_curve_branch* br;
+int lo;
+int mpct;
+
+br=&c->branch[charging ? CAPACITY_CURVE_CHARGE : CAPACITY_CURVE_DISCHARGE];
+lo=capacity_curve_segment(br,c->size,mv);
+if (lo < 0) return c->percent[0]*1000;
+if (lo >= c->size-1) return c->percent[c->size-1]*1000;
+mpct=c->percent[lo]*1000+(int)(((s64)(mv-br->vstart[lo])*br->slope[lo]*1000)>>CAPACITY_CURVE_SHIFT);
+if (mpct > c->percent[lo+1]*1000) mpct=c->percent[lo+1]*1000;
+return mpct;
+}
+
+//*****************************************************
+//*  Наклон кривой в точке, %/мВ << CAPACITY_CURVE_SHIFT
+//*****************************************************
+// За краями таблицы наклон нулевой: напряжение там уровень заряда не меняет
+int capacity_curve_slope(const struct capacity_curve* c, int mv, int charging) {
+
+const struct capacity_curve_branch* br;
+int lo;
+
+br=&c->branch[charging ? CAPACITY_CURVE_CHARGE : CAPACITY_CURVE_DISCHARGE];
+lo=capacity_curve_segment(br,c->size,mv);
+if ((lo < 0) || (lo >= c->size-1)) return 0;
+return br->slope[lo];
+}
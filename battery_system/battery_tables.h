@@ -0,0 +1,78 @@
+#ifndef _BATTERY_TABLES_H
+#define _BATTERY_TABLES_H
+
+#include <linux/types.h>
+
+//*****************************************************
+//*  Таблица перевода напряжения в температуру
+//*****************************************************
+struct ntc_tvm {
+   int tntc;   // температура, C
+   int tnvc;   // напряжение на NTC, мкВ
+};
+
+//*****************************************************
+//*  Предвычисленная таблица поиска температуры NTC
+//*****************************************************
+// Строится один раз из таблицы ntc_tvm. Напряжения узлов строго убывают, поиск
+// сегмента - бинарный, внутри сегмента температура интерполируется линейно
+// с точностью 0.1 C, за краями таблицы значение ограничивается крайним узлом.
+
+#define NTC_LOOKUP_MAX_ROWS 64
+#define NTC_LOOKUP_SHIFT    20   // дробные биты наклона сегмента
+
+struct ntc_lookup {
+  int size;
+  int tnvc[NTC_LOOKUP_MAX_ROWS];   // напряжения узлов, мкВ, по убыванию
+  int temp[NTC_LOOKUP_MAX_ROWS];   // температура узлов, 0.1 C
+  int slope[NTC_LOOKUP_MAX_ROWS];  // наклон сегмента i..i+1, 0.1 C/мкВ << NTC_LOOKUP_SHIFT
+};
+
+int ntc_lookup_build(struct ntc_lookup* l, const struct ntc_tvm* tbl, int size);
+int ntc_lookup_temp(const struct ntc_lookup* l, int uv, int* clamped);
+
+//*****************************************************
+//*  Таблица соответствия напряжения и уровня заряда
+//*****************************************************
+struct capacity {
+  int percent;
+  int vmin;
+  int vmax;
+  int offset;
+  int hysteresis;
+};
+
+//*****************************************************
+//*  Скомпилированная кривая емкости
+//*****************************************************
+// Строится из строк struct capacity. Для разряда и для зарядки (с учетом offset строки)
+// хранится своя ветка: начала сегментов и наклоны в фиксированной точке, так что
+// поиск - бисекция по началам сегментов, а пересчет - одно умножение без деления.
+
+#define CAPACITY_CURVE_MAX_ROWS 32
+#define CAPACITY_CURVE_SHIFT    16   // дробные биты наклона сегмента
+
+#define CAPACITY_CURVE_DISCHARGE 0
+#define CAPACITY_CURVE_CHARGE    1
+
+struct capacity_curve_branch {
+  int vstart[CAPACITY_CURVE_MAX_ROWS];  // начало сегмента i, мВ
+  int slope[CAPACITY_CURVE_MAX_ROWS];   // наклон сегмента i..i+1, %/мВ << CAPACITY_CURVE_SHIFT
+};
+
+struct capacity_curve {
+  int size;
+  int percent[CAPACITY_CURVE_MAX_ROWS];  // уровень заряда в начале сегмента
+  int band_lo[CAPACITY_CURVE_MAX_ROWS];  // vmin-hysteresis строки
+  int band_hi[CAPACITY_CURVE_MAX_ROWS];  // vmax+hysteresis строки
+  struct capacity_curve_branch branch[2];
+};
+
+int capacity_curve_build(struct capacity_curve* c, const struct capacity* rows, int size);
+int capacity_curve_percent(const struct capacity_curve* c, int mv, int charging);
+int capacity_curve_changed(const struct capacity_curve* c, int percent, int mv);
+int capacity_curve_segment(const struct capacity_curve_branch* br, int size, int mv);
+int capacity_curve_mpercent(const struct capacity_curve* c, int mv, int charging);
+int capacity_curve_slope(const struct capacity_curve* c, int mv, int charging);
+
+#endif
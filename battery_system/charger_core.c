@@ -14,10 +14,19 @@
 #include <linux/bitops.h>
 #include <linux/rtc.h>
 #include <linux/mutex.h>
+#include <linux/spinlock.h>
 #include <linux/regulator/driver.h>
 #include <linux/regulator/of_regulator.h>
 #include <linux/regulator/machine.h>
 #include <linux/qpnp/qpnp-adc.h>
+#include <linux/rculist.h>
+#include <linux/kref.h>
+#include <linux/completion.h>
+#include <linux/notifier.h>
+#include <linux/hash.h>
+#include <linux/dcache.h>
+#include <linux/list.h>
+#include <linux/workqueue.h>
 
 #include "battery_core.h"
 #include "charger_core.h"
@@ -26,13 +35,25 @@
 //********************************************
 //* хранилище зарегистрированных зарядников  *
 //********************************************
-static struct charger_core_interface* registered_chip[10]={0,0,0,0,0,0,0,0,0,0}; 
-static int registered_count=0;
+// Хеш-таблица по имени батареи. Поиск идет под rcu_read_lock без блокировок,
+// изменение таблицы - под charger_core_registry_lock.
+#define CHARGER_CORE_HASH_BITS 4
+
+static struct hlist_head charger_core_registry[1<<CHARGER_CORE_HASH_BITS];
+static DEFINE_MUTEX(charger_core_registry_lock);
+static BLOCKING_NOTIFIER_HEAD(charger_core_notifier);
+
+u32 charger_core_hash(const char* name) {
+
+return hash_32(full_name_hash((const unsigned char*)name,strlen(name)),CHARGER_CORE_HASH_BITS);
+}
 
 
 //********************************************
 //* Получение информации об источнике питания
 //********************************************
+// Свойства источника запрашиваются у его power supply только после
+// charger_core_adapter_changed, в остальное время используется кеш max_ma.
 int charger_core_get_adapter(struct adapter *ada) {
 
 int online,rc,current_max,scope,voltage_now;  
@@ -41,41 +62,163 @@ union power_supply_propval prop;
 
 if (ada == 0) return -EPERM;
 // для безымянных адаптеров
-if (ada->name == 0) {
+if ((ada->name == 0) || (ada->name[0] == 0)) {
   ada->max_ma=0;
   return 0;
 }  
+// кеш актуален
+if (atomic_xchg(&ada->stale,0) == 0) return 0;
 // если имя имеется - ищем power supply* по имени.
 if (ada->psy == 0) ada->psy=power_supply_get_by_name(ada->name);
-if (ada->psy != 0) {
-  rc=ada->psy->get_property(ada->psy,POWER_SUPPLY_PROP_ONLINE,&prop);
-  if (rc == 0) online=prop.intval;
-  else  online=0;
-  rc=ada->psy->get_property(ada->psy,POWER_SUPPLY_PROP_CURRENT_MAX,&prop);
-  if (rc != 0) current_max=0;
-  else    current_max=prop.intval/1000;
-
-  rc=ada->psy->get_property(ada->psy,POWER_SUPPLY_PROP_VOLTAGE_NOW,&prop);
-  if (rc != 0) voltage_now=0;
-  else voltage_now=prop.intval/1000;
+if (ada->psy == 0) {
+  // источник еще не зарегистрирован - повторим поиск при следующем обращении
+  atomic_set(&ada->stale,1);
+  ada->max_ma=0;
+  return 0;
+}
+rc=ada->psy->get_property(ada->psy,POWER_SUPPLY_PROP_ONLINE,&prop);
+if (rc == 0) online=prop.intval;
+else  online=0;
+rc=ada->psy->get_property(ada->psy,POWER_SUPPLY_PROP_CURRENT_MAX,&prop);
+if (rc != 0) current_max=0;
+else    current_max=prop.intval/1000;
+
+rc=ada->psy->get_property(ada->psy,POWER_SUPPLY_PROP_VOLTAGE_NOW,&prop);
+if (rc != 0) voltage_now=0;
+else voltage_now=prop.intval/1000;
   
-  rc=ada->psy->get_property(ada->psy,POWER_SUPPLY_PROP_SCOPE,&prop);
-  if (rc == 0) scope=prop.intval;
-  else scope=0;
+rc=ada->psy->get_property(ada->psy,POWER_SUPPLY_PROP_SCOPE,&prop);
+if (rc == 0) scope=prop.intval;
+else scope=0;
   
-  if (online == 0) current_max=0;
-}
-else current_max=0;
+if (online == 0) current_max=0;
 ada->max_ma=current_max;
-if (ada->name == 0) return 0;
-if (strlen(ada->name) != 0) 
-   pr_info("adapter[%s]: psy=%08x scope=%d, online=%d, current_max=%dmA, voltage_now=%dmV\n",ada->name,ada->psy,scope,online,current_max,voltage_now);
+pr_info("adapter[%s]: psy=%08x scope=%d, online=%d, current_max=%dmA, voltage_now=%dmV\n",ada->name,ada->psy,scope,online,current_max,voltage_now);
 return 0;
 }
 
+//********************************************
+//* Сброс кеша источников питания
+//********************************************
+// Вызывается по уведомлению об изменении power supply. psy=0 - изменились
+// все источники (поставщик уведомления неизвестен). Допускается вызов из
+// обработчиков прерываний: только помечает кеш, опрос идет при следующей
+// установке тока.
+void charger_core_adapter_changed(struct charger_interface* api, struct power_supply* psy) {
+
+struct adapter* ada[4];
+int i;
+
+if (api == 0) return;
+ada[0]=&api->ad_usb;
+ada[1]=&api->ad128;
+ada[2]=&api->ad144;
+ada[3]=&api->ad160;
+for (i=0;i<4;i++) {
+  if ((psy != 0) && (ada[i]->psy != psy) && 
+      ((ada[i]->name == 0) || (psy->name == 0) || (strcmp(ada[i]->name,psy->name) != 0))) continue;
+  atomic_set(&ada[i]->stale,1);
+}
+}
+
   
 
 
+//********************************************
+//*  Состояние аппаратуры зарядника
+//********************************************
+// charger_core помнит последние записанные в драйвер ограничение тока и
+// разрешение зарядки и передает драйверу только изменения. Ошибка драйвера
+// делает значение неизвестным (-1), следующий вызов запишет его заново.
+// Принудительная запись всего состояния - charger_core_hw_resync.
+void charger_core_hw_resync(struct charger_interface* api) {
+
+struct charger_core_interface* chip;
+
+if (api == 0) return;
+chip=api->self;
+if (chip == 0) return;
+atomic_set(&chip->hw_resync,1);
+}
+
+// вызывается под chip->mutx
+void charger_core_hw_check_resync(struct charger_core_interface* chip) {
+
+if (atomic_xchg(&chip->hw_resync,0) == 0) return;
+chip->hw_limit_ma=-1;
+chip->hw_enable=-1;
+}
+
+int charger_core_hw_set_limit(struct charger_core_interface* chip, int mA) {
+
+struct charger_interface* api=chip->api;
+int rc;
+
+if (api->set_current_limit_fn == 0) return 0;
+if (chip->hw_limit_ma == mA) return 0;
+rc=(*api->set_current_limit_fn)(api->parent,mA);
+if (rc < 0) {
+  // ограничение в аппаратуре неизвестно - при следующей записи состояние передается целиком
+  chip->hw_limit_ma=-1;
+  atomic_set(&chip->hw_resync,1);
+  return rc;
+}
+chip->hw_limit_ma=mA;
+return 0;
+}
+
+int charger_core_hw_set_enable(struct charger_core_interface* chip, int enable) {
+
+struct charger_interface* api=chip->api;
+int rc;
+
+if (api->enable_charge_fn == 0) return 0;
+if (chip->hw_enable == enable) return 0;
+rc=(*api->enable_charge_fn)(api->parent,enable);
+if (rc != 0) chip->hw_enable=-1;
+else chip->hw_enable=enable;
+return rc;
+}
+
+// Запись итогового ограничения тока, вызывается под chip->mutx
+int charger_core_hw_apply(struct charger_core_interface* chip, int mA) {
+
+int enable,changed,rc;
+
+enable=((mA != 0) && (chip->charging_suspend == 0));
+charger_core_hw_check_resync(chip);
+changed=(chip->hw_limit_ma != mA) || (chip->hw_enable != enable);
+// без нового ограничения зарядку не разрешаем - ток остался бы прежним
+rc=charger_core_hw_set_limit(chip,mA);
+if (rc != 0) return rc;
+rc=charger_core_hw_set_enable(chip,enable);
+if (rc != 0) return rc;
+chip->ichg_now=mA;
+chip->charging_state=( (mA==0) ? POWER_SUPPLY_STATUS_NOT_CHARGING : POWER_SUPPLY_STATUS_CHARGING);
+if (changed) pr_info("ichg=%dmA at %s, limited by %s\n",mA,(mA==0?"not_charging":"charging"),charger_voter_effective_client(&chip->ibat));
+return 0;
+}
+
+//********************************************
+//*  Голосование за ток зарядки
+//********************************************
+// Итоговый ток - минимум из голосов. Все голоса подаются под chip->mutx.
+static const char* const charger_core_ibat_clients[CHARGER_IBAT_CLIENTS]={
+  "request",    // CHARGER_IBAT_REQUEST
+  "ibat_max",   // CHARGER_IBAT_USER
+  "ichg_max",   // CHARGER_IBAT_CHARGER
+  "adapter",    // CHARGER_IBAT_ADAPTER
+};
+
+int charger_core_ibat_changed(struct charger_voter* v, int mA, void* data) {
+
+struct charger_core_interface* chip=data;
+
+// пока battery_core не запрашивал ток, аппаратура не трогается
+if ((v->votes & (1u<<CHARGER_IBAT_REQUEST)) == 0) return 0;
+return charger_core_hw_apply(chip,mA);
+}
+
 //********************************************
 //*  Приостановка зарядки 
 //********************************************
@@ -89,11 +232,15 @@ if (self == 0) return -EINVAL;
 chip=api->self;
 if (chip == 0) return 0;
 if (api->enable_charge_fn == 0) return 0;
-if (chip->charging_state != POWER_SUPPLY_STATUS_CHARGING) return -EINVAL; 
-if (chip->charging_suspend != 0) return -EINVAL;
 
-rc=(*api->enable_charge_fn)(api->parent,0);
-if (rc == 0) chip->charging_suspend=1;
+mutex_lock(&chip->mutx);
+if ((chip->charging_state != POWER_SUPPLY_STATUS_CHARGING) || (chip->charging_suspend != 0)) rc=-EINVAL;
+else {
+  charger_core_hw_check_resync(chip);
+  rc=charger_core_hw_set_enable(chip,0);
+  if (rc == 0) chip->charging_suspend=1;
+}
+mutex_unlock(&chip->mutx);
 return rc;
 }
 
@@ -111,11 +258,15 @@ if (self == 0) return -EINVAL;
 chip=api->self;
 if (chip == 0) return 0;
 if (api->enable_charge_fn == 0) return 0;
-if (chip->charging_state != POWER_SUPPLY_STATUS_CHARGING) return -EINVAL; 
-if (chip->charging_suspend == 0) return -EINVAL;
   
-rc=(*api->enable_charge_fn)(api->parent,1);
-if (rc == 0) chip->charging_suspend=1;
+mutex_lock(&chip->mutx);
+if ((chip->charging_state != POWER_SUPPLY_STATUS_CHARGING) || (chip->charging_suspend == 0)) rc=-EINVAL;
+else {
+  charger_core_hw_check_resync(chip);
+  rc=charger_core_hw_set_enable(chip,1);
+  if (rc == 0) chip->charging_suspend=0;
+}
+mutex_unlock(&chip->mutx);
 return rc;
 }
 
@@ -128,9 +279,6 @@ struct charger_interface* api=self;
 struct charger_core_interface* chip;
 int rc;
 int max_src_ma;
-int max_bat_ma;
-int max_ma;
-int enable;
 
 if ((self == 0) || (mA<0)) return -EINVAL;
 chip=api->self;
@@ -153,29 +301,25 @@ charger_core_get_adapter(&api->ad160);
 max_src_ma=max(api->ad_usb.max_ma,api->ad128.max_ma);
 max_src_ma=max(max_src_ma,api->ad144.max_ma);
 
-max_bat_ma=min(chip->ichg_max, chip->ibat_max);
-max_ma=min(max_src_ma, max_bat_ma);
-max_ma=min(max_ma,mA);
-if (max_ma == 0) enable=0;
-else enable=1;
-
-rc=0;
-if (api->set_current_limit_fn != 0) {
-  rc=(*api->set_current_limit_fn)(api->parent,max_ma);
-}
+// события, поставленные в очередь до этого вызова (в т.ч. окончание зарядки),
+// выполняются раньше, чем charging_done будет сброшен
+charger_core_flush_events(api);
 
-if (api->enable_charge_fn != 0) {
-  rc=(*api->enable_charge_fn)(api->parent, enable);
-}
+// оба голоса учитываются без обработчика, чтобы промежуточный итог не
+// попал в драйвер; итог уходит в драйвер одной записью и только при изменении.
+// Запись снимает приостановку зарядки и восстанавливает состояние аппаратуры
+// после resync, при неизменном состоянии она ничего не делает
+mutex_lock(&chip->mutx);
+chip->charging_suspend=0;
+rc=charger_vote_defer(&chip->ibat,CHARGER_IBAT_ADAPTER,1,max_src_ma);
+if (rc == 0) rc=charger_vote_defer(&chip->ibat,CHARGER_IBAT_REQUEST,1,mA);
+if (rc == 0) rc=charger_core_hw_apply(chip,charger_voter_value(&chip->ibat));
+if (rc == 0) chip->charging_done=0;
+mutex_unlock(&chip->mutx);
 if (rc != 0) {
-  pr_err("failed to set charging current(%dmA) at driver layer!\n",max_ma);
+  pr_err("failed to set charging current(%dmA) at driver layer!\n",charger_voter_value(&chip->ibat));
   return rc;
 }
-chip->charging_suspend=0;
-chip->charging_done=0;
-chip->ichg_now=max_ma;
-chip->charging_state=( (enable==0) ? POWER_SUPPLY_STATUS_NOT_CHARGING : POWER_SUPPLY_STATUS_CHARGING);
-pr_info("ichg=%dmA at %s\n",max_ma,(enable==0?"not_charging":"charging"));
 return 0;
 }
 
@@ -237,50 +381,224 @@ return -EPERM;
 //********************************************
 //*    Обработчик событий
 //********************************************
-int charger_core_notify_event(void *self, int event, void *params) {
+// Выполняется в очереди событий зарядника
+int charger_core_handle_event(struct charger_interface* api, int event, int ma) {
   
-struct charger_interface* api=self;
-struct charger_core_interface* chip;
-int ma;
+struct charger_core_interface* chip=api->self;
 int rc;
 
-if (self == 0) return -EINVAL;
-chip=api->self;
-if (chip == 0) return -EINVAL;
-
 switch(event) {
   case 1:
     // информация об окончании зарядки
+    mutex_lock(&chip->mutx);
     chip->charging_done=1;
+    mutex_unlock(&chip->mutx);
   case 2:
   case 3:
     return 0;
     // установка нового зарядного тока
-  case 4: 
-    if (params == 0) return 0;
-    ma=*((int*)params);
-    if (ma == chip->ibat_max) return 0;
-    chip->ibat_max=ma;
-    if (chip->charging_state != POWER_SUPPLY_STATUS_CHARGING) return 0;
-    if (api->set_charging_current == 0) return 0;
-    rc=api->set_charging_current(api,ma);    
-    if (rc != 0) pr_err("failed to adjust charging current %dmA to %dmA\n",chip->ichg_now,chip->ibat_max);
+  case CHARGER_CORE_EVENT_IBAT: 
+    if (ma < 0) return 0;
+    mutex_lock(&chip->mutx);
+    rc=charger_vote(&chip->ibat,CHARGER_IBAT_USER,1,ma);
+    mutex_unlock(&chip->mutx);
+    if (rc != 0) pr_err("failed to adjust charging current %dmA to %dmA\n",chip->ichg_now,ma);
     return rc;
-  default:
-    pr_err("no such event(%d)!",event);
-    return -EPERM;
 }
+return -EPERM;
+}
+
+//********************************************
+//*    Очередь событий зарядника
+//********************************************
+// События выполняются по одному в порядке поступления в собственной очереди
+// зарядника, так что операции с драйвером не задерживают вызывающего.
+// События состояния (1-3) выполняются все и по порядку. Идущие подряд
+// ожидающие события 4 без ожидания результата сливаются: выполняется
+// только последнее значение тока.
+void charger_core_event_work(struct work_struct* work) {
+
+struct charger_core_interface* chip=container_of(work, struct charger_core_interface, event_work);
+struct charger_core_event* ev;
+unsigned long flags;
+
+for (;;) {
+  spin_lock_irqsave(&chip->queue_lock,flags);
+  if (list_empty(&chip->event_list)) {
+    spin_unlock_irqrestore(&chip->queue_lock,flags);
+    return;
+  }
+  ev=list_first_entry(&chip->event_list, struct charger_core_event, node);
+  list_del(&ev->node);
+  spin_unlock_irqrestore(&chip->queue_lock,flags);
+
+  ev->rc=charger_core_handle_event(chip->api,ev->event,ev->ma);
+  // ожидающая запись живет в стеке вызывающего, остальные освобождаем сами
+  if (ev->wait != 0) complete(&ev->done);
+  else kfree(ev);
+}
+}
+
+// wait=CHARGER_CORE_EVENT_WAIT - дождаться выполнения и вернуть его результат,
+// иначе событие только ставится в очередь. Ожидание недопустимо из самой
+// очереди событий и в атомарном контексте.
+int charger_core_queue_event(struct charger_interface* api, int event, void* params, int wait) {
+
+struct charger_core_interface* chip;
+struct charger_core_event* ev;
+struct charger_core_event* last;
+struct charger_core_event sync;
+unsigned long flags;
+int ma;
+
+if (api == 0) return -EINVAL;
+chip=api->self;
+if (chip == 0) return -EINVAL;
+if ((event < 1) || (event > CHARGER_CORE_EVENT_IBAT)) {
+  pr_err("no such event(%d)!",event);
+  return -EPERM;
+}
+if ((event == CHARGER_CORE_EVENT_IBAT) && (params != 0)) ma=*((int*)params);
+else ma=-1;
+
+if (wait != 0) {
+  ev=&sync;
+  init_completion(&ev->done);
+}  
+else {
+  ev=kmalloc(sizeof(*ev),GFP_ATOMIC);
+  if (ev == 0) return -ENOMEM;
+}  
+ev->event=event;
+ev->ma=ma;
+ev->wait=wait;
+ev->rc=0;
+
+spin_lock_irqsave(&chip->queue_lock,flags);
+if ((wait == 0) && (event == CHARGER_CORE_EVENT_IBAT) && !list_empty(&chip->event_list)) {
+  last=list_entry(chip->event_list.prev, struct charger_core_event, node);
+  if ((last->event == CHARGER_CORE_EVENT_IBAT) && (last->wait == 0)) {
+    // последнее значение тока заменяет еще не выполненное предыдущее
+    last->ma=ma;
+    spin_unlock_irqrestore(&chip->queue_lock,flags);
+    kfree(ev);
+    return 0;
+  }
+}
+list_add_tail(&ev->node,&chip->event_list);
+spin_unlock_irqrestore(&chip->queue_lock,flags);
+queue_work(chip->event_queue,&chip->event_work);
+
+if (wait == 0) return 0;
+wait_for_completion(&ev->done);
+return ev->rc;
+}
+
+// Ожидание выполнения всех поставленных в очередь событий.
+// Недопустимо из самой очереди событий и в атомарном контексте.
+void charger_core_flush_events(struct charger_interface* api) {
+
+struct charger_core_interface* chip;
+
+if (api == 0) return;
+chip=api->self;
+if (chip == 0) return;
+flush_workqueue(chip->event_queue);
+}
+
+int charger_core_notify_event(void *self, int event, void *params) {
+
+return charger_core_queue_event(self,event,params,0);
 }
     
     
     
+//********************************************
+//* Установка обработчика событий зарядника
+//********************************************
+// handler=0 отключает канал; после возврата обработчик гарантированно не выполняется
+int charger_core_set_event_handler(struct charger_core_interface* chip, void (*handler)(void*, unsigned int), void* data) {
+
+unsigned long flags;
+
+if (chip == 0) return -EINVAL;
+spin_lock_irqsave(&chip->event_lock,flags);
+chip->event_handler=handler;
+chip->event_data=data;
+spin_unlock_irqrestore(&chip->event_lock,flags);
+return 0;
+}
+
+//********************************************
+//* Передача событий зарядника в battery_core
+//********************************************
+// Вызывается из обработчиков прерываний драйвера зарядника
+void charger_core_report_event(struct charger_interface* api, unsigned int events) {
+
+struct charger_core_interface* chip;
+unsigned long flags;
+
+if ((api == 0) || (events == 0)) return;
+// источник питания подключен или отключен - свойства адаптеров устарели,
+// а зарядник мог сбросить входной ток: следующая установка пишет все заново
+if (events & CHARGER_EVENT_SOURCE) charger_core_adapter_changed(api,0);
+// структура зарядника освобождается через rcu после charger_core_unregister
+rcu_read_lock();
+chip=ACCESS_ONCE(api->self);
+if (chip != 0) {
+  if (events & (CHARGER_EVENT_SOURCE | CHARGER_EVENT_FAULT)) atomic_set(&chip->hw_resync,1);
+  spin_lock_irqsave(&chip->event_lock,flags);
+  if (chip->event_handler != 0) (*chip->event_handler)(chip->event_data,events);
+  spin_unlock_irqrestore(&chip->event_lock,flags);
+}
+rcu_read_unlock();
+}
+
+//********************************************
+//* Учет ссылок на зарядник
+//********************************************
+// Ссылку, полученную из charger_core_get_charger_interface_by_name или
+// charger_core_get, необходимо вернуть через charger_core_put.
+struct charger_core_interface* charger_core_get(struct charger_core_interface* chip) {
+
+if (chip != 0) kref_get(&chip->ref);
+return chip;
+}
+
+void charger_core_release(struct kref* ref) {
+
+struct charger_core_interface* chip=container_of(ref, struct charger_core_interface, ref);
+
+complete(&chip->released);
+}
+
+void charger_core_put(struct charger_core_interface* chip) {
+
+if (chip != 0) kref_put(&chip->ref,charger_core_release);
+}
+
+//********************************************
+//* Уведомления о регистрации зарядников
+//********************************************
+// Вызывается с событием CHARGER_CORE_REGISTERED или CHARGER_CORE_UNREGISTERED,
+// данные - struct charger_core_interface*. Обработчик, которому нужен зарядник
+// после возврата, берет собственную ссылку через charger_core_get.
+int charger_core_register_notifier(struct notifier_block* nb) {
+
+return blocking_notifier_chain_register(&charger_core_notifier,nb);
+}
+
+int charger_core_unregister_notifier(struct notifier_block* nb) {
+
+return blocking_notifier_chain_unregister(&charger_core_notifier,nb);
+}
+
 //********************************************
 //* Регистрация драйвера зарядника
 //********************************************
 int charger_core_register(struct device* dev, struct charger_interface* api) {
 
 struct charger_core_interface* chip;
-int i; 
 
 if ((dev == 0) || (api == 0)) return -EINVAL;
 if (api->parent == 0) return -EINVAL;  // нет собственной управляющей структуры
@@ -290,19 +608,43 @@ if (chip == 0) {
   pr_err("cannot allocate memory!\n");
   return -ENOMEM;
 }
+chip->event_queue=alloc_ordered_workqueue("charger_core_events",WQ_MEM_RECLAIM);
+if (chip->event_queue == 0) {
+  pr_err("cannot create event queue!\n");
+  kfree(chip);
+  return -ENOMEM;
+}
+spin_lock_init(&chip->queue_lock);
+INIT_LIST_HEAD(&chip->event_list);
+INIT_WORK(&chip->event_work,charger_core_event_work);
 //pr_err("register chip=%08x api=%08x\n",chip,api);
 chip->dev=dev;
 mutex_init(&chip->mutx);
+spin_lock_init(&chip->event_lock);
+chip->event_handler=0;
+chip->event_data=0;
 chip->api=api;
 chip->charging_suspend=0;
 chip->charging_done=0;
-chip->ichg_max=2000;
 chip->charging_state=3;
-chip->ibat_max=2000;
 chip->irechg_max=2000;
 chip->recharging_state=3;
 chip->ichg_now=0;
 chip->recharging_suspend=0;	
+chip->hw_limit_ma=-1;   // состояние аппаратуры неизвестно
+chip->hw_enable=-1;
+atomic_set(&chip->hw_resync,0);
+charger_voter_init(&chip->ibat,"ibat",CHARGER_VOTER_MIN,0,charger_core_ibat_clients,CHARGER_IBAT_CLIENTS,
+                   charger_core_ibat_changed,chip);
+// ограничения по умолчанию: зарядник и батарея - 2000мА
+charger_vote(&chip->ibat,CHARGER_IBAT_CHARGER,1,2000);
+charger_vote(&chip->ibat,CHARGER_IBAT_USER,1,2000);
+if (api->ext_name_battery != 0) strlcpy(chip->name,api->ext_name_battery,sizeof(chip->name));
+kref_init(&chip->ref);   // ссылка самого реестра
+init_completion(&chip->released);
+
+// первое обращение к адаптерам опрашивает их power supply
+charger_core_adapter_changed(api,0);
 
 api->self=chip;  // обратная связь от интерфейса charger_core_interface к интерфейсу charger_interface
 api->suspend_charging=charger_core_suspend_charging;
@@ -315,32 +657,58 @@ api->resume_recharging = charger_core_resume_recharging;
 api->set_recharging_current = 0;
 api->notify_event = charger_core_notify_event;
 
-if (registered_count <9) {
-  for (i=0;i<10;i++) {
-    if (registered_chip[i] != 0) continue;
-    registered_chip[i]=chip;
-    registered_count++;
-    break;
-  }  
-}
+mutex_lock(&charger_core_registry_lock);
+hlist_add_head_rcu(&chip->node,&charger_core_registry[charger_core_hash(chip->name)]);
+mutex_unlock(&charger_core_registry_lock);
+blocking_notifier_call_chain(&charger_core_notifier,CHARGER_CORE_REGISTERED,chip);
 pr_info("Charger Core Version 4.1.5 (Built at %s %s)!",__DATE__,__TIME__);
 return 0; 
 }
 
+//********************************************
+//* Удаление драйвера зарядника
+//********************************************
+// Ждет возврата всех ссылок, после выхода структура charger_core недоступна
+void charger_core_unregister(struct charger_interface* api) {
+
+struct charger_core_interface* chip;
+
+if (api == 0) return;
+chip=api->self;
+if (chip == 0) return;
+
+mutex_lock(&charger_core_registry_lock);
+hlist_del_rcu(&chip->node);
+mutex_unlock(&charger_core_registry_lock);
+blocking_notifier_call_chain(&charger_core_notifier,CHARGER_CORE_UNREGISTERED,chip);
+charger_core_put(chip);
+wait_for_completion(&chip->released);
+// оставшиеся в очереди события выполняются до удаления
+destroy_workqueue(chip->event_queue);
+charger_core_set_event_handler(chip,0,0);
+charger_voter_destroy(&chip->ibat);
+rcu_assign_pointer(api->self,0);
+kfree_rcu(chip,rcu);
+}
+
 //*************************************************8
 //* Поиск зарядника по имени
 //*************************************************8
+// Возвращает зарядник со взятой ссылкой или 0
 struct charger_core_interface* charger_core_get_charger_interface_by_name(const unsigned char* name) {
 
-int i;
+struct charger_core_interface* chip;
+struct charger_core_interface* found=0;
   
 if (name == 0) return 0;
 if (name[0] == 0) return 0;
 
-for (i=0;i<10;i++) {
-  if (registered_chip[i] == 0) continue;
-  if (strcmp(registered_chip[i]->api->ext_name_battery,name) == 0) return registered_chip[i];
+rcu_read_lock();
+hlist_for_each_entry_rcu(chip,&charger_core_registry[charger_core_hash(name)],node) {
+  if (strcmp(chip->name,name) != 0) continue;
+  if (kref_get_unless_zero(&chip->ref) != 0) found=chip;
+  break;
 }
-return 0;
+rcu_read_unlock();
+return found;
 }
-
@@ -1,4 +1,8 @@
 #include <linux/regulator/driver.h>
+#include <linux/kref.h>
+#include <linux/completion.h>
+#include <linux/notifier.h>
+#include "charger_voter.h"
 
 struct charger_info {
  int charger_status;
@@ -24,6 +28,7 @@ struct adapter {
   struct power_supply* psy;
   int max_ma;  // максимальный ток, отдаваемый источником
   int af12;
+  atomic_t stale;  // max_ma устарел, нужен опрос power supply
 };  
   
 //******************************************************************************
@@ -91,8 +96,8 @@ struct charger_interface  {
   bool  temp_monitor_disabled; // 482
   bool  resume_completed;  // 483
   bool	irq_waiting;  // 484
-  u32	usb_suspended; // 488
-  u32	dc_suspended;  // 492
+  struct charger_voter usb_suspend;  // причины отключения входа USB, голосование ANY
+  struct charger_voter dc_suspend;   // причины отключения входа DC
   struct mutex	path_suspend_lock;  // 496, 40 байт
   u32	peek_poke_address; // 536
   struct smb135x_regulator  otg_vreg; //540
@@ -107,12 +112,49 @@ struct charger_interface  {
   struct delayed_work wireless_insertion_work;  // 700, размер 76 
   unsigned int	thermal_levels; //776
   unsigned int	therm_lvl_sel; // 780
+  struct charger_voter usb_icl;  // входной ток USB: запрос charger_core и тепловое ограничение
   unsigned int* thermal_mitigation; // 784
   struct mutex	current_change_lock; // 788, 40 байт
   
 };
 
 
+//*************************************************************
+//* События зарядника, передаваемые в battery_core
+//*************************************************************
+// битовая маска, события между запусками монитора накапливаются
+#define CHARGER_EVENT_SOURCE       0x01  // подключение или отключение источника питания
+#define CHARGER_EVENT_CHARGE_DONE  0x02  // окончание или запрет зарядки
+#define CHARGER_EVENT_BATTERY      0x04  // установка или извлечение аккумулятора
+#define CHARGER_EVENT_TEMP         0x08  // температура аккумулятора вышла за пороги зарядника
+#define CHARGER_EVENT_FAULT        0x10  // аварийные события: перегрев зарядника, таймаут зарядки
+
+//*************************************************************
+//* Клиенты голосования за ток зарядки
+//*************************************************************
+enum charger_core_ibat_client {
+  CHARGER_IBAT_REQUEST,   // ток, запрошенный battery_core через set_charging_current
+  CHARGER_IBAT_USER,      // ibat_max батареи, событие 4
+  CHARGER_IBAT_CHARGER,   // возможности зарядника (ichg_max)
+  CHARGER_IBAT_ADAPTER,   // наибольший ток подключенных источников
+  CHARGER_IBAT_CLIENTS
+};
+
+//*************************************************************
+//* Очередь событий notify_event
+//*************************************************************
+#define CHARGER_CORE_EVENT_IBAT  4   // новое ограничение тока батареи, params - int* мА
+#define CHARGER_CORE_EVENT_WAIT  1   // charger_core_queue_event: дождаться выполнения
+
+struct charger_core_event {
+  struct list_head node;
+  int event;
+  int ma;                  // ток для события 4, -1 - не задан
+  int wait;                // вызывающий ждет на done, запись в его стеке
+  int rc;
+  struct completion done;
+};
+
 //*************************************************************
 //* Структура интерфейса между charger_core и battery_core
 //*************************************************************
@@ -122,8 +164,7 @@ struct charger_core_interface {
  struct charger_interface* api; // 0
  struct device* dev; // 4
  struct mutex	mutx;   // 8, 40 байт
- int ibat_max;    // 48 
- int ichg_max;    // 52 
+ struct charger_voter ibat;  // ограничение тока зарядки, клиенты CHARGER_IBAT_*
  int ichg_now;    // 56
  int charging_state;    // 60
  int charging_suspend;  // 64
@@ -131,10 +172,49 @@ struct charger_core_interface {
  int irechg_max;  // 72
  int recharging_state;  // 76
  int recharging_suspend;  // 80
- 
+
+ // последнее записанное в драйвер состояние, -1 - неизвестно; защищено mutx
+ int hw_limit_ma;
+ int hw_enable;
+ atomic_t hw_resync;   // при следующей установке тока записать все заново
+
+ // очередь событий notify_event
+ struct workqueue_struct* event_queue;
+ struct work_struct event_work;
+ spinlock_t queue_lock;
+ struct list_head event_list;
+
+ // канал событий к battery_core
+ spinlock_t event_lock;                                // защита обработчика
+ void (*event_handler)(void* data, unsigned int events); // вызывается из прерываний зарядника
+ void* event_data;
+
+ // реестр зарядников
+ char name[32];               // имя батареи (ext_name_battery), ключ поиска
+ struct hlist_node node;
+ struct kref ref;
+ struct completion released;  // все ссылки возвращены
+ struct rcu_head rcu;
 }; 
 
+//*************************************************************
+//* События реестра зарядников
+//*************************************************************
+#define CHARGER_CORE_REGISTERED    1
+#define CHARGER_CORE_UNREGISTERED  2
+
 
 struct charger_core_interface* charger_core_get_charger_interface_by_name(const unsigned char* name);
+struct charger_core_interface* charger_core_get(struct charger_core_interface* chip);
+void charger_core_put(struct charger_core_interface* chip);
+int charger_core_register_notifier(struct notifier_block* nb);
+int charger_core_unregister_notifier(struct notifier_block* nb);
 int charger_core_register(struct device* dev, struct charger_interface* api);
+void charger_core_unregister(struct charger_interface* api);
+int charger_core_set_event_handler(struct charger_core_interface* chip, void (*handler)(void*, unsigned int), void* data);
+void charger_core_report_event(struct charger_interface* api, unsigned int events);
+int charger_core_queue_event(struct charger_interface* api, int event, void* params, int wait);
+void charger_core_flush_events(struct charger_interface* api);
+void charger_core_hw_resync(struct charger_interface* api);
+void charger_core_adapter_changed(struct charger_interface* api, struct power_supply* psy);
 
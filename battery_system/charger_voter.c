@@ -0,0 +1,178 @@
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/bitops.h>
+#include <linux/mutex.h>
+#include "charger_voter.h"
+
+//*****************************************************
+//*  Инициализация голосования
+//*****************************************************
+int charger_voter_init(struct charger_voter* v, const char* name, int type, int default_value,
+                       const char* const* clients, int num_clients, charger_voter_cb callback, void* data) {
+
+if ((v == 0) || (num_clients <= 0) || (num_clients > CHARGER_VOTER_MAX_CLIENTS)) return -EINVAL;
+v->name=name;
+v->type=type;
+v->clients=clients;
+v->num_clients=num_clients;
+v->votes=0;
+v->default_value=default_value;
+v->effective=default_value;
+v->effective_client=-1;
+v->callback=callback;
+v->data=data;
+mutex_init(&v->lock);
+return 0;
+}
+
+void charger_voter_destroy(struct charger_voter* v) {
+
+mutex_destroy(&v->lock);
+}
+
+//*****************************************************
+//*  Сравнение голосов
+//*****************************************************
+// 1, если голос a определяет итог вместо b
+int charger_voter_better(struct charger_voter* v, int a, int b) {
+
+if (v->type == CHARGER_VOTER_MAX) return a > b;
+return a < b;
+}
+
+//*****************************************************
+//*  Пересчет итога по всем голосам
+//*****************************************************
+// Нужен только когда клиент, определявший итог, ослабил или снял свой голос;
+// проход ограничен CHARGER_VOTER_MAX_CLIENTS.
+void charger_voter_rescan(struct charger_voter* v) {
+
+u32 votes=v->votes;
+int i;
+
+v->effective=v->default_value;
+v->effective_client=-1;
+while (votes != 0) {
+  i=__ffs(votes);
+  votes&=~(1u<<i);
+  if ((v->effective_client < 0) || charger_voter_better(v,v->value[i],v->effective)) {
+    v->effective=v->value[i];
+    v->effective_client=i;
+  }
+}
+}
+
+//*****************************************************
+//*  Учет голоса одного клиента
+//*****************************************************
+// Итог пересчитывается за постоянное время: новый голос либо становится
+// итогом, либо не влияет на него. Полный пересчет - только если ослаб голос
+// клиента, который определял итог.
+void charger_voter_update(struct charger_voter* v, int client, int enable, int value) {
+
+u32 bit=1u<<client;
+
+if (v->type == CHARGER_VOTER_ANY) {
+  if (enable != 0) v->votes|=bit;
+  else v->votes&=~bit;
+  v->value[client]=1;
+  v->effective=(v->votes != 0);
+  v->effective_client=(v->votes != 0) ? __ffs(v->votes) : -1;
+  return;
+}
+
+if (enable == 0) {
+  v->votes&=~bit;
+  if (v->effective_client == client) charger_voter_rescan(v);
+  return;
+}
+v->votes|=bit;
+v->value[client]=value;
+if ((v->effective_client < 0) || charger_voter_better(v,value,v->effective)) {
+  v->effective=value;
+  v->effective_client=client;
+}
+else if (v->effective_client == client) charger_voter_rescan(v);
+}
+
+//*****************************************************
+//*  Подача или снятие голоса
+//*****************************************************
+// force - вызвать обработчик, даже если итог не изменился (аппаратура
+// потеряла состояние), отрицательный force - не вызывать обработчик вовсе.
+// При ошибке обработчика голос не учитывается.
+int charger_voter_cast(struct charger_voter* v, int client, int enable, int value, int force) {
+
+u32 votes;
+int old_value,effective,effective_client;
+int rc=0;
+
+if ((v == 0) || (client < 0) || (client >= v->num_clients)) return -EINVAL;
+mutex_lock(&v->lock);
+votes=v->votes;
+old_value=v->value[client];
+effective=v->effective;
+effective_client=v->effective_client;
+
+charger_voter_update(v,client,enable,value);
+if ((force >= 0) && ((v->effective != effective) || (force > 0)) && (v->callback != 0)) {
+  rc=(*v->callback)(v,v->effective,v->data);
+  if (rc < 0) {
+    pr_err("%s: %s voted %d, callback failed rc=%d\n",v->name,v->clients[client],value,rc);
+    v->votes=votes;
+    v->value[client]=old_value;
+    v->effective=effective;
+    v->effective_client=effective_client;
+  }
+}
+mutex_unlock(&v->lock);
+return (rc < 0) ? rc : 0;
+}
+
+int charger_vote(struct charger_voter* v, int client, int enable, int value) {
+
+return charger_voter_cast(v,client,enable,value,0);
+}
+
+int charger_vote_apply(struct charger_voter* v, int client, int enable, int value) {
+
+return charger_voter_cast(v,client,enable,value,1);
+}
+
+// Голос учитывается без вызова обработчика: несколько голосов подряд меняют
+// итог один раз, применить его вызывающий должен сам
+int charger_vote_defer(struct charger_voter* v, int client, int enable, int value) {
+
+return charger_voter_cast(v,client,enable,value,-1);
+}
+
+//*****************************************************
+//*  Чтение результатов
+//*****************************************************
+int charger_voter_value(struct charger_voter* v) {
+
+return ACCESS_ONCE(v->effective);
+}
+
+// Возвращает 0 и значение голоса клиента или -ENODATA, если клиент не голосует
+int charger_voter_client_value(struct charger_voter* v, int client, int* value) {
+
+int rc=-ENODATA;
+
+if ((v == 0) || (client < 0) || (client >= v->num_clients)) return -EINVAL;
+mutex_lock(&v->lock);
+if (v->votes & (1u<<client)) {
+  if (value != 0) *value=v->value[client];
+  rc=0;
+}
+mutex_unlock(&v->lock);
+return rc;
+}
+
+const char* charger_voter_effective_client(struct charger_voter* v) {
+
+int client=ACCESS_ONCE(v->effective_client);
+
+if (client < 0) return "none";
+return v->clients[client];
+}
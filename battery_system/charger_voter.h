@@ -0,0 +1,51 @@
+#ifndef _CHARGER_VOTER_H
+#define _CHARGER_VOTER_H
+
+#include <linux/types.h>
+#include <linux/mutex.h>
+
+//*****************************************************
+//*  Голосование за ограничения зарядника
+//*****************************************************
+// Несколько независимых источников (клиентов) подают голоса за один параметр,
+// итоговое значение - минимум, максимум или признак наличия хотя бы одного
+// голоса. Обработчик вызывается только при изменении итогового значения,
+// под блокировкой голосования, так что записи в аппаратуру упорядочены.
+
+#define CHARGER_VOTER_MAX_CLIENTS 8
+
+enum charger_voter_type {
+  CHARGER_VOTER_MIN,   // наименьшее из поданных значений
+  CHARGER_VOTER_MAX,   // наибольшее из поданных значений
+  CHARGER_VOTER_ANY,   // 1, если голосует хотя бы один клиент, иначе 0
+};
+
+struct charger_voter;
+typedef int (*charger_voter_cb)(struct charger_voter* v, int value, void* data);
+
+struct charger_voter {
+  const char* name;
+  int type;
+  const char* const* clients;  // имена клиентов, номер клиента - индекс
+  int num_clients;
+  int value[CHARGER_VOTER_MAX_CLIENTS];
+  u32 votes;              // маска голосующих клиентов
+  int effective;          // итоговое значение
+  int effective_client;   // клиент, определивший итог, -1 - голосов нет
+  int default_value;      // итог при отсутствии голосов
+  charger_voter_cb callback;
+  void* data;
+  struct mutex lock;
+};
+
+int charger_voter_init(struct charger_voter* v, const char* name, int type, int default_value,
+                       const char* const* clients, int num_clients, charger_voter_cb callback, void* data);
+void charger_voter_destroy(struct charger_voter* v);
+int charger_vote(struct charger_voter* v, int client, int enable, int value);
+int charger_vote_apply(struct charger_voter* v, int client, int enable, int value);
+int charger_vote_defer(struct charger_voter* v, int client, int enable, int value);
+int charger_voter_value(struct charger_voter* v);
+int charger_voter_client_value(struct charger_voter* v, int client, int* value);
+const char* charger_voter_effective_client(struct charger_voter* v);
+
+#endif
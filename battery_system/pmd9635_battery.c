@@ -65,6 +65,8 @@ if (b9635data->rtcfd == 0) {
   b9635data->rtcfd=rd;
 }
 
+// интервал пробуждения в мс предлагает battery_core, иначе - 600 с
+var1=600000;
 if (b9635data->x_timer_suspend_proc != 0) ret=b9635data->x_timer_suspend_proc(b9635data->bat,&var1);
 if (ret == 0) ret=var1/1000;
   else ret=600;
@@ -137,6 +139,66 @@ pr_err("pmd9635_battery_get_vntc: can't get battery temperature, rc=%d\n",ret);
 return ret;
 }
 
+//**************************************
+//*  Пакетное чтение канала АЦП
+//**************************************
+// Каждое преобразование VADC уже усредняет hw_avg выборок (qcom,fast-avg-setup канала),
+// поэтому на count запрошенных выборок делаем count/hw_avg преобразований подряд, без
+// программных пауз, но не меньше 3 - иначе усеченному среднему нечего отбрасывать.
+// spread (может быть 0) - разброс max-min между преобразованиями пакета
+int pmd9635_battery_get_adc_batch(struct battery_interface* b9635data, int channel, int count, int* val, int* spread) {
+
+int data[BATTERY_MON_BURST_SAMPLES];
+int i,n;
+int ret;
+
+if ((b9635data == 0) || (val == 0) || (count <= 0)) return -EINVAL;
+
+n=count/((channel == b9635data->vbat) ? b9635data->hw_avg_vbat : b9635data->hw_avg_tbat);
+if (n<3) n=3;
+if (n>BATTERY_MON_BURST_SAMPLES) n=BATTERY_MON_BURST_SAMPLES;
+
+for (i=0;i<n;i++) {
+  ret=pmd9635_get_adc_value(channel,&data[i]);
+  // причину ошибки уже сообщил pmd9635_get_adc_value
+  if (ret != 0) return ret;
+}
+*val=battery_core_calculate_average_n(data,n);
+if (spread != 0) *spread=battery_core_calculate_spread(data,n);
+return 0;
+}
+
+//**************************************
+//*  Аппаратное усреднение канала VADC
+//**************************************
+// Число выборок, которые VADC усредняет за одно преобразование, берется из
+// qcom,fast-avg-setup узла канала chan@<channel> самого VADC, так что оно
+// всегда совпадает с настройкой АЦП. Канал не найден - усреднения нет.
+int pmd9635_battery_channel_avg(int channel) {
+
+struct device_node* vadc;
+struct device_node* chan;
+u32 reg;
+u32 setup=0;
+int found=0;
+
+if (channel < 0) return 1;
+for_each_compatible_node(vadc,0,"qcom,qpnp-vadc") {
+  for_each_child_of_node(vadc,chan) {
+    if ((of_property_read_u32(chan,"reg",&reg) != 0) || (reg != channel)) continue;
+    if (of_property_read_u32(chan,"qcom,fast-avg-setup",&setup) != 0) setup=0;
+    found=1;
+    of_node_put(chan);
+    break;
+  }
+  if (found) {
+    of_node_put(vadc);
+    break;
+  }
+}
+if (setup > 8) setup=8;
+return 1<<setup;
+}
 
   
 //***********************************************
@@ -194,6 +256,11 @@ if (vbat_channel>=0)  b9635data->get_vbat_proc=pmd9635_battery_get_vbat;
 
 if (tbat_channel>=0)  b9635data->get_vntc_proc=pmd9635_battery_get_vntc;
  else b9635data->get_vntc_proc=0;
+
+// аппаратное усреднение - из настроек каналов vbat/tbat самого VADC
+b9635data->hw_avg_vbat=pmd9635_battery_channel_avg(vbat_channel);
+b9635data->hw_avg_tbat=pmd9635_battery_channel_avg(tbat_channel);
+b9635data->get_adc_batch_proc=pmd9635_battery_get_adc_batch;
  
 ret=battery_core_register(dparent,b9635data);
 if (ret != 0) {
@@ -208,7 +275,8 @@ rd=rtc_class_open(rtcdevname);
 b9635data->rtcfd=rd;
 rtc_timer_init(&b9635data->rtctimer,&pmd9635_battery_alarm_wakeup,(void*)b9635data);
 
-printk(KERN_INFO "%s: vbat_channel=%d, tbat_channel=%d\n",procname,vbat_channel,tbat_channel);
+printk(KERN_INFO "%s: vbat_channel=%d, tbat_channel=%d, hw_avg=%d/%d\n",procname,vbat_channel,tbat_channel,
+       b9635data->hw_avg_vbat,b9635data->hw_avg_tbat);
 return 0;
 }
 
@@ -276,10 +276,30 @@ static char *version_str[] = {
 	[V_SMB1359] = "smb1359",
 };
 
+/* path suspend voter clients */
 enum {
-	USER = BIT(0),
-	THERMAL = BIT(1),
-	CURRENT = BIT(2),
+	USER,
+	THERMAL,
+	CURRENT,
+	SUSPEND_REASONS,
+};
+
+static const char * const smb135x_suspend_reasons[SUSPEND_REASONS] = {
+	[USER]		= "user",
+	[THERMAL]	= "thermal",
+	[CURRENT]	= "current",
+};
+
+/* usb input current limit voter clients */
+enum {
+	ICL_CORE,
+	ICL_THERMAL,
+	ICL_CLIENTS,
+};
+
+static const char * const smb135x_icl_clients[ICL_CLIENTS] = {
+	[ICL_CORE]	= "charger_core",
+	[ICL_THERMAL]	= "thermal",
 };
 
 enum path_type {
@@ -707,40 +727,32 @@ static int __smb135x_dc_suspend(struct smb135x_chg *chip, bool suspend) {
 //*
 //************************************************
 
-static int smb135x_path_suspend(struct smb135x_chg *chip, enum path_type path,int reason, bool suspend) {
-	int rc = 0;
-	int suspended;
-	int *path_suspended;
-	int (*func)(struct smb135x_chg *chip, bool suspend);
+static int smb135x_usb_suspend_cb(struct charger_voter *v, int suspend, void *data)
+{
+	return __smb135x_usb_suspend(data, suspend);
+}
 
-	mutex_lock(&chip->core.path_suspend_lock);
-	if (path == USB) {
-		suspended = chip->core.usb_suspended;
-		path_suspended = &chip->core.usb_suspended;
-		func = __smb135x_usb_suspend;
-	} else {
-		suspended = chip->core.dc_suspended;
-		path_suspended = &chip->core.dc_suspended;
-		func = __smb135x_dc_suspend;
-	}
+static int smb135x_dc_suspend_cb(struct charger_voter *v, int suspend, void *data)
+{
+	return __smb135x_dc_suspend(data, suspend);
+}
 
-	if (suspend == false)
-		suspended &= ~reason;
-	else
-		suspended |= reason;
+static int smb135x_path_suspend(struct smb135x_chg *chip, enum path_type path,int reason, bool suspend) {
+	int rc;
+	struct charger_voter *voter;
 
-	if (*path_suspended && !suspended)
-		rc = func(chip, 0);
-	if (!(*path_suspended) && suspended)
-		rc = func(chip, 1);
+	if (path == USB)
+		voter = &chip->core.usb_suspend;
+	else
+		voter = &chip->core.dc_suspend;
 
+	/* the path is suspended while any reason votes for it */
+	mutex_lock(&chip->core.path_suspend_lock);
+	rc = charger_vote(voter, reason, suspend, 1);
 	if (rc)
 		dev_err(chip->dev, "Couldn't set/unset suspend for %s path rc = %d\n",
 					path == USB ? "usb" : "dc",
 					rc);
-	else
-		*path_suspended = suspended;
-
 	mutex_unlock(&chip->core.path_suspend_lock);
 	return rc;
 }
@@ -753,30 +765,35 @@ static int hot_hard_handler(struct smb135x_chg *chip, u8 rt_stat)
 {
 	pr_debug("rt_stat = 0x%02x\n", rt_stat);
 	chip->core.batt_hot = !!rt_stat;
+	charger_core_report_event(&chip->core, CHARGER_EVENT_TEMP);
 	return 0;
 }
 static int cold_hard_handler(struct smb135x_chg *chip, u8 rt_stat)
 {
 	pr_debug("rt_stat = 0x%02x\n", rt_stat);
 	chip->core.batt_cold = !!rt_stat;
+	charger_core_report_event(&chip->core, CHARGER_EVENT_TEMP);
 	return 0;
 }
 static int hot_soft_handler(struct smb135x_chg *chip, u8 rt_stat)
 {
 	pr_debug("rt_stat = 0x%02x\n", rt_stat);
 	chip->core.batt_warm = !!rt_stat;
+	charger_core_report_event(&chip->core, CHARGER_EVENT_TEMP);
 	return 0;
 }
 static int cold_soft_handler(struct smb135x_chg *chip, u8 rt_stat)
 {
 	pr_debug("rt_stat = 0x%02x\n", rt_stat);
 	chip->core.batt_cool = !!rt_stat;
+	charger_core_report_event(&chip->core, CHARGER_EVENT_TEMP);
 	return 0;
 }
 static int battery_missing_handler(struct smb135x_chg *chip, u8 rt_stat)
 {
 	pr_debug("rt_stat = 0x%02x\n", rt_stat);
 	chip->core.batt_present = !rt_stat;
+	charger_core_report_event(&chip->core, CHARGER_EVENT_BATTERY);
 	return 0;
 }
 static int vbat_low_handler(struct smb135x_chg *chip, u8 rt_stat)
@@ -787,12 +804,14 @@ static int vbat_low_handler(struct smb135x_chg *chip, u8 rt_stat)
 static int chg_hot_handler(struct smb135x_chg *chip, u8 rt_stat)
 {
 	pr_warn("chg hot\n");
+	charger_core_report_event(&chip->core, CHARGER_EVENT_FAULT);
 	return 0;
 }
 static int chg_term_handler(struct smb135x_chg *chip, u8 rt_stat)
 {
 	pr_debug("rt_stat = 0x%02x\n", rt_stat);
 	chip->core.chg_done_batt_full = !!rt_stat;
+	charger_core_report_event(&chip->core, CHARGER_EVENT_CHARGE_DONE);
 	return 0;
 }
 
@@ -818,6 +837,7 @@ static int recharge_handler(struct smb135x_chg *chip, u8 rt_stat)
 static int safety_timeout_handler(struct smb135x_chg *chip, u8 rt_stat)
 {
 	pr_warn("safety timeout rt_stat = 0x%02x\n", rt_stat);
+	charger_core_report_event(&chip->core, CHARGER_EVENT_FAULT);
 	return 0;
 }
 
@@ -901,6 +921,7 @@ static int dcin_uv_handler(struct smb135x_chg *chip, u8 rt_stat)
 		chip->core.dc_present = dc_present;
 		handle_dc_insertion(chip);
 	}
+	charger_core_report_event(&chip->core, CHARGER_EVENT_SOURCE);
 
 	return 0;
 }
@@ -929,6 +950,7 @@ static int dcin_ov_handler(struct smb135x_chg *chip, u8 rt_stat)
 		chip->core.dc_present = dc_present;
 		handle_dc_insertion(chip);
 	}
+	charger_core_report_event(&chip->core, CHARGER_EVENT_SOURCE);
 	return 0;
 }
 
@@ -1006,6 +1028,7 @@ static int usbin_uv_handler(struct smb135x_chg *chip, u8 rt_stat)
 		chip->core.usb_present = usb_present;
 		handle_usb_removal(chip);
 	}
+	charger_core_report_event(&chip->core, CHARGER_EVENT_SOURCE);
 	return 0;
 }
 
@@ -1031,6 +1054,7 @@ static int usbin_ov_handler(struct smb135x_chg *chip, u8 rt_stat)
 					: POWER_SUPPLY_HEALTH_GOOD;
 		power_supply_set_health_state(chip->core.usb_psy, health);
 	}
+	charger_core_report_event(&chip->core, CHARGER_EVENT_SOURCE);
 
 	return 0;
 }
@@ -1053,6 +1077,7 @@ static int src_detect_handler(struct smb135x_chg *chip, u8 rt_stat)
 		chip->core.usb_present = usb_present;
 		handle_usb_insertion(chip);
 	}
+	charger_core_report_event(&chip->core, CHARGER_EVENT_SOURCE);
 
 	return 0;
 }
@@ -1066,6 +1091,7 @@ static int chg_inhibit_handler(struct smb135x_chg *chip, u8 rt_stat)
 	 */
 	pr_debug("rt_stat = 0x%02x\n", rt_stat);
 	chip->core.chg_done_batt_full = !!rt_stat;
+	charger_core_report_event(&chip->core, CHARGER_EVENT_CHARGE_DONE);
 	return 0;
 }
 
@@ -1233,7 +1259,7 @@ static int smb135x_irq_read(struct smb135x_chg *chip) {
 	 */
 	mutex_lock(&chip->core.path_suspend_lock);
 
-	if (chip->core.dc_suspended)
+	if (charger_voter_value(&chip->core.dc_suspend))
 		__smb135x_dc_suspend(chip, false);
 
 	for (i = 0; i < ARRAY_SIZE(handlers); i++) {
@@ -1247,7 +1273,7 @@ static int smb135x_irq_read(struct smb135x_chg *chip) {
 		}
 	}
 
-	if (chip->core.dc_suspended)
+	if (charger_voter_value(&chip->core.dc_suspend))
 		__smb135x_dc_suspend(chip, true);
 
 	mutex_unlock(&chip->core.path_suspend_lock);
@@ -1569,6 +1595,22 @@ static int force_rechg_set(void *data, u64 val)
 }
 DEFINE_SIMPLE_ATTRIBUTE(force_rechg_ops, NULL, force_rechg_set, "0x%02llx\n");
 
+int smb135x_set_thermal_level(struct smb135x_chg *chip, unsigned int lvl);
+
+static int thermal_level_get(void *data, u64 *val)
+{
+	struct smb135x_chg *chip = data;
+
+	*val = chip->core.therm_lvl_sel;
+	return 0;
+}
+
+static int thermal_level_set(void *data, u64 val)
+{
+	return smb135x_set_thermal_level(data, val);
+}
+DEFINE_SIMPLE_ATTRIBUTE(thermal_level_ops, thermal_level_get, thermal_level_set, "%llu\n");
+
 #define FIRST_CMD_REG	0x40
 #define LAST_CMD_REG	0x42
 static int show_cmd_regs(struct seq_file *m, void *data)
@@ -2609,6 +2651,8 @@ static int smb135x_resume(struct device *dev)
 			dev_err(chip->dev,
 				"Couldn't restore irq cfg regs rc=%d\n", rc);
 	}
+	/* registers may have been changed while asleep */
+	charger_core_hw_resync(&chip->core);
 	mutex_lock(&chip->core.irq_complete);
 	chip->core.resume_completed = true;
 	if (chip->core.irq_waiting) {
@@ -2772,7 +2816,6 @@ int smb135x_set_current_limit(void *self, int mA) {
 struct smb135x_chg* chip=self; 
 int rc;  
 int usb_supply_type;
-int therm_ma,current_ma;
 
 if ((chip == 0) || (mA<0)) {
     dev_err(chip->dev, "Error parameters in smb135x_set_current_limit\n");
@@ -2790,18 +2833,47 @@ if (chip->core.batt_present == 0) {
   pr_info("ignoring current request since battery is absent\n");
   return -EPERM;
 }  
-if ((chip->core.therm_lvl_sel != 0) && (chip->core.therm_lvl_sel < (chip->core.thermal_levels-1)))
-    therm_ma=chip->core.thermal_mitigation[chip->core.therm_lvl_sel];
-else therm_ma=chip->core.usb_psy_ma;  
-current_ma = min(therm_ma, chip->core.usb_psy_ma);
-rc=smb135x_set_usb_chg_current(chip,current_ma);
+// charger_core вызывает нас только при изменении тока или после потери
+// состояния аппаратуры, поэтому итог записывается даже если он не изменился
+rc=charger_vote_apply(&chip->core.usb_icl,ICL_CORE,1,mA);
 if (rc<0) {
-  dev_err(chip->dev,"Couldn't set USB current to min(%d, %d) rc = %d\n",therm_ma,chip->core.usb_psy_ma,rc);
+  dev_err(chip->dev,"Couldn't set USB current to %d rc = %d\n",charger_voter_value(&chip->core.usb_icl),rc);
   return -EPERM;
 }
 return 1;
 }
 
+//**************************************
+//* Запись входного тока USB
+//**************************************
+// Вызывается голосованием usb_icl при изменении итогового тока
+int smb135x_usb_icl_cb(struct charger_voter* v, int current_ma, void* data) {
+
+struct smb135x_chg* chip=data;
+
+// до первого запроса charger_core вход не настраиваем
+if ((v->votes & (1u<<ICL_CORE)) == 0) return 0;
+pr_info("[Core]USB input current %dmA, limited by %s\n",current_ma,charger_voter_effective_client(v));
+return smb135x_set_usb_chg_current(chip,current_ma);
+}
+
+//**************************************
+//* Уровень теплового ограничения
+//**************************************
+// 0 и последний уровень таблицы qcom,thermal-mitigation ограничения не задают
+int smb135x_set_thermal_level(struct smb135x_chg* chip, unsigned int lvl) {
+
+int enable;
+int rc;
+
+if ((chip->core.thermal_levels == 0) || (lvl >= chip->core.thermal_levels)) return -EINVAL;
+enable=((lvl != 0) && (lvl < (chip->core.thermal_levels-1)));
+rc=charger_vote(&chip->core.usb_icl,ICL_THERMAL,enable,enable ? chip->core.thermal_mitigation[lvl] : 0);
+// при ошибке голос откатывается, уровень остается прежним
+if (rc == 0) chip->core.therm_lvl_sel=lvl;
+return rc;
+}
+
 //**************************************
 //* Включение-отключение зарядки
 //**************************************
@@ -2897,6 +2969,11 @@ mutex_init(&chip->core.path_suspend_lock);
 mutex_init(&chip->core.current_change_lock);
 mutex_init(&chip->read_write_lock);
 
+// голосования за ограничения входов
+charger_voter_init(&chip->core.usb_suspend,"usb_suspend",CHARGER_VOTER_ANY,0,smb135x_suspend_reasons,SUSPEND_REASONS,smb135x_usb_suspend_cb,chip);
+charger_voter_init(&chip->core.dc_suspend,"dc_suspend",CHARGER_VOTER_ANY,0,smb135x_suspend_reasons,SUSPEND_REASONS,smb135x_dc_suspend_cb,chip);
+charger_voter_init(&chip->core.usb_icl,"usb_icl",CHARGER_VOTER_MIN,0,smb135x_icl_clients,ICL_CLIENTS,smb135x_usb_icl_cb,chip);
+
 // детектим чип - читаем его регистр CFG4
 rc = smb135x_read(chip, CFG_4_REG, &reg);
 if (rc != 0) {
@@ -3037,7 +3114,7 @@ if (client->irq) {
 			IRQF_TRIGGER_LOW | IRQF_ONESHOT,"smb135x_chg_stat_irq", chip);
 	if (rc < 0) {
 	 dev_err(&client->dev,"request_irq for irq=%d  failed rc = %d\n",client->irq, rc);
-	 goto unregister_dc_psy;
+	 goto unregister_charger_core;
 	}
 	enable_irq_wake(client->irq);
 }
@@ -3078,11 +3155,14 @@ else  {
 	ent = debugfs_create_file("force_recharge",S_IFREG | S_IWUSR | S_IRUGO,chip->core.debug_root, chip,&force_rechg_ops);
 	if (!ent) dev_err(chip->dev,"Couldn't create recharge debug file rc = %d\n",rc);
 
-	ent = debugfs_create_x32("usb_suspend_votes",S_IFREG | S_IWUSR | S_IRUGO,chip->core.debug_root,&(chip->core.usb_suspended));
+	ent = debugfs_create_x32("usb_suspend_votes",S_IFREG | S_IRUGO,chip->core.debug_root,&(chip->core.usb_suspend.votes));
 	if (!ent) dev_err(chip->dev,"Couldn't create usb vote file rc = %d\n",rc);
 
-	ent = debugfs_create_x32("dc_suspend_votes",S_IFREG | S_IWUSR | S_IRUGO,chip->core.debug_root,&(chip->core.dc_suspended));
+	ent = debugfs_create_x32("dc_suspend_votes",S_IFREG | S_IRUGO,chip->core.debug_root,&(chip->core.dc_suspend.votes));
 	if (!ent) dev_err(chip->dev,"Couldn't create dc vote file rc = %d\n",rc);
+
+	ent = debugfs_create_file("thermal_level",S_IFREG | S_IWUSR | S_IRUGO,chip->core.debug_root, chip,&thermal_level_ops);
+	if (!ent) dev_err(chip->dev,"Couldn't create thermal level file rc = %d\n",rc);
 }
 
 dev_info(chip->dev, "SMB135X version = %s revision = %s successfully probed batt=%d dc = %d usb = %d\n",
@@ -3091,7 +3171,9 @@ dev_info(chip->dev, "SMB135X version = %s revision = %s successfully probed batt
 return 0;
 
 // выходы по ошикам
-unregister_dc_psy:
+unregister_charger_core:
+// после регистрации зарядник уже мог быть найден и привязан battery_core
+charger_core_unregister(&chip->core);
 free_regulator:
 
 smb135x_regulator_deinit(chip);
@@ -3105,6 +3187,8 @@ static int smb135x_charger_remove(struct i2c_client *client) {
 	int rc;
 	struct smb135x_chg *chip = i2c_get_clientdata(client);
 
+	charger_core_unregister(&chip->core);
+
 	if (chip->core.therm_bias_vreg) {
 		rc = regulator_disable(chip->core.therm_bias_vreg);
 		if (rc)
@@ -3119,6 +3203,10 @@ static int smb135x_charger_remove(struct i2c_client *client) {
 
 	smb135x_regulator_deinit(chip);
 
+	charger_voter_destroy(&chip->core.usb_icl);
+	charger_voter_destroy(&chip->core.dc_suspend);
+	charger_voter_destroy(&chip->core.usb_suspend);
+
 	return 0;
 }
 
@@ -11,6 +11,7 @@
 #include <linux/of.h>
 #include <linux/mod_devicetable.h>
 #include <linux/qpnp/qpnp-adc.h>
+#include "battery_system/battery_tables.h"
 
 int32_t jrd_qpnp_vadc_read(enum qpnp_vadc_channels channel,struct qpnp_vadc_result *result);
 
@@ -30,6 +31,7 @@ struct battery_interface {
   struct power_supply psy;
   struct device* dev; 
   struct device* parent;
+  struct capacity_curve capcurve;  // кривая емкости, строится из battery_capacity_table
 };
 
 //*************************************************
@@ -52,15 +54,6 @@ static enum power_supply_property pmd9635_battery_props[] = {
 //*  Таблица соответствия напряжения и уровня заряда
 //*****************************************************
 
-struct capacity {
-  int percent;
-  int vmin;
-  int vmax;
-  int offset;
-  int hysteresis;
-};
-  
-// 
 struct capacity battery_capacity_table[]= {
 //  %       vmin     vmax   offset hysteresis
    {0,      3100,    3597,    0,    10},
@@ -153,18 +146,13 @@ return ret;
 //**************************************
 int pmd9635_battery_get_capacity(struct battery_interface* batdata, int* val) {
   
-int i,volt;
+int volt;
+int ret;
 
-pmd9635_battery_get_vbat(batdata, &volt);
+ret=pmd9635_battery_get_vbat(batdata, &volt);
+if (ret != 0) return ret;
 volt/=1000; // переводим в милливольты
-for(i=0;i<battery_capacity_table_size;i++) {
-  if ((volt>battery_capacity_table[i].vmin) && (volt<battery_capacity_table[i].vmax)) {
-    *val=battery_capacity_table[i].percent;
-//    pr_err("pmd9635_battery_get_capacity: volt=%i percent=%i",volt,*val);
-//    return 1;
-  }  
-}
-//pr_err("pmd9635_battery_get_capacity: error, volt=%i",volt);
+*val=capacity_curve_percent(&batdata->capcurve,volt,batdata->charging_status != POWER_SUPPLY_STATUS_DISCHARGING);
 return 0;
 }
 
@@ -258,6 +246,12 @@ batdata->psy.properties = pmd9635_battery_props,
 batdata->psy.num_properties = ARRAY_SIZE(pmd9635_battery_props),
 batdata->batt_health=POWER_SUPPLY_HEALTH_GOOD;
 batdata->charging_status=POWER_SUPPLY_STATUS_NOT_CHARGING;
+ret=capacity_curve_build(&batdata->capcurve,battery_capacity_table,battery_capacity_table_size);
+if (ret != 0) {
+  pr_err("%s: invalid capacity convert table, rc=%d\n",procname,ret);
+  kfree(batdata);
+  return ret;
+}
 dev_set_drvdata(&pdev->dev,batdata);
 
 if (of_property_read_u32_array(pdev->dev.of_node, "pmd9635-battery,vbat-channel", &vbat_channel, 1) != 0) {